@@ -1,14 +1,24 @@
+#define _GNU_SOURCE // fopencookie
+
 #include <pwd.h>
 #include <grp.h>
 #include <stdio.h>
 #include <utime.h>
 #include <unistd.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <string.h>
+#include <limits.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <linux/kdev_t.h>
+#include <linux/io_uring.h>
 
 #define REGULAR      0
 #define NORMAL      '0'
@@ -57,40 +67,451 @@ typedef union record
 	char block[512]; // raw memory (padded to 1 block)
 }Record;
 
+typedef struct pathchunk
+{
+	struct pathchunk* prev;
+	struct pathchunk* next;
+	size_t used;
+	size_t size;
+	u_int64_t live; // paths still referenced by the table
+	char data[];
+} pathChunk;
+
 typedef struct inode
 {
-	u_int64_t inode;
+	u_int64_t dev;
+	u_int64_t inode; // 0 marks an empty slot
+	u_int64_t links; // links not yet archived
 	char* path;
-	struct inode* next;
+	pathChunk* chunk;
 } iNode;
 
-typedef struct huffmannode
+typedef struct linktable
+{
+	iNode* slot;
+	u_int64_t capacity; // power of two
+	u_int64_t count;
+	pathChunk* chunk; // newest first, paths are appended to the head
+	pathChunk* retired; // emptied by the last call, freed by the next one
+} linkTable;
+
+typedef struct idname
 {
-	int ch;
-	struct huffmannode* left;
-	struct huffmannode* right;
-} huffmanNode;
+	u_int64_t id;
+	int used;
+	char name[32]; // what goes into the owner/group field, empty for an id with no name
+} idName;
 
-typedef struct linknode
+typedef struct namecache
 {
-	u_int64_t frequency;
-	huffmanNode* node;
-	struct linknode* next;
-} linkNode;
+	idName* slot;
+	u_int64_t capacity; // power of two
+	u_int64_t count;
+} nameCache;
 
 typedef struct huffmanitem
 {
 	unsigned char length;
-	char* huffmanCode;
+	u_int32_t huffmanCode; // canonical code, right aligned
 } huffmanItem;
 
-iNode iNodeHead;
+typedef struct huffmancontext
+{
+	u_int64_t frequency[256];
+	huffmanItem table[256];
+} huffmanContext;
+
+typedef struct fseentry
+{
+	unsigned char symbol;
+	unsigned char bits; // read after the symbol
+	u_int16_t next;     // next state before those bits are added
+} fseEntry;
+
+#define HF_MAGIC           "HF"
+#define HF_VERSION         6
+#define HF_MIN_VERSION     2    // oldest stream still read, v2 has no HF_LZ77 blocks, v3 no HF_TAR, v4 no HF_HUFFMAN4, v5 no HF_FSE
+#define HF_HUFFMAN         0    // block types
+#define HF_STORED          1    // data follows uncompressed
+#define HF_SINGLE          2    // one byte value repeated, stored once
+#define HF_LZ77            3    // LZ_STREAMS nested blocks of the types above, see encodeLz77()
+#define HF_TAR             4    // tar header records and the other bytes as two nested blocks, see encodeTarBlock()
+#define HF_HUFFMAN4        5    // HF_HUFFMAN with the symbols cut into HUFFMAN_STREAMS bitstreams, sizes up front
+#define HF_FSE             6    // tANS: table log, normalized counts, then FSE_STATES interleaved states read from the end
+#define HF_END             0xff // no more blocks, the block index follows
+#define HF_INDEX_MAGIC     "HFIX"
+#define HF_TRAILER_SIZE    12   // index offset (8 bytes little endian) and HF_INDEX_MAGIC
+
+#define HUFFMAN_MAX_LENGTH 15
+#define DECODE_TABLE_BITS  11
+#define DECODE_SYMBOLS     4
+#define HUFFMAN_STREAMS    4
+#define FSE_MIN_LOG        11 // table logs tried, the larger follows the counts closer
+#define FSE_MAX_LOG        12
+#define FSE_STATES         2  // symbols alternate between them so the decoder has two table walks in flight
+#define FSE_MIN            (1 << 10) // shorter blocks stay on Huffman, the count table would not pay off
+#define HUFFMAN4_MIN       (1 << 12) // shorter blocks keep one bitstream, the size table would not pay off
+#define IO_BUFFER_SIZE     (1 << 20)
+#define IO_ALIGN           4096
+#undef BLOCK_SIZE // linux/fs.h, pulled in by io_uring.h, has its own
+#define BLOCK_SIZE         (1 << 20)
+#define MAX_BLOCK_SIZE     (1 << 26)
+#define BLOCK_SLACK        64 // block header and bit writer overrun
+#define BLOCK_HEADER_ROOM  21 // type and two varint sizes, kept free in front of a payload of unknown size
+#define RING_BLOCKS        4  // blocks buffered between tar() and compress()
+#define PATH_CHUNK_SIZE    (1 << 16)
+#define LINK_TABLE_SIZE    1024
+#define NAME_CACHE_SIZE    16
+#define LZ_MIN_MATCH       4
+#define LZ_HASH_BITS       16
+#define LZ_STREAMS         4  // literals, sequence tokens, long run/length extras, distances
+#define HISTOGRAM_WAYS     4  // sub-histograms, a run of one byte value no longer waits on one counter
+#define HISTOGRAM_SEGMENT  (1u << 30) // bytes per flush, keeps the 32 bit sub-counters from wrapping
+#define REPEAT_SHARE       100 // a random-looking block with this small a share of long repeats is not worth LZ77
+#define REPEAT_PROBE       8
+#define STORE_SEGMENT      (1 << 16) // judged on its own when deciding whether to store a block raw
+#define STORE_SAMPLE_SHIFT 2  // a quarter of each segment is read for that
+#define SAMPLE_CHUNK       256 // sampled counting reads this much out of every SAMPLE_CHUNK << shift bytes
+
+// the IFUNC resolver behind target_clones runs before ThreadSanitizer is set up and crashes it
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__) && !defined(__SANITIZE_THREAD__)
+#define HISTOGRAM_CLONES __attribute__((target_clones("avx2", "default"))) // picked once at load time by the CPU
+#else
+#define HISTOGRAM_CLONES
+#endif
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define BIG_ENDIAN_64(x) (x)
+#define LITTLE_ENDIAN_64(x) __builtin_bswap64(x)
+#else
+#define BIG_ENDIAN_64(x) __builtin_bswap64(x) // bitstreams are most significant bit first on every host
+#define LITTLE_ENDIAN_64(x) (x)
+#endif
+#define WALK_THREADS_PER_CPU 4       // traversal threads mostly wait on metadata I/O
+#define WALK_PENDING_LIMIT (1 << 16) // entries found but not yet archived before scanners pause
+#define WALK_OPEN_FILES    256       // files scanners may hold open for the writer
+#define WALK_PREFETCH_SIZE (1 << 20) // files up to this size are read ahead whole
+
+#define IO_RING_ENTRIES    1024      // submission queue entries, completions get twice as many
+#define IO_RING_FILES      256       // files being created and written at once
+#define IO_RING_FILE_SIZE  (1 << 16) // larger files are written synchronously
+#define IO_RING_PATH_HASH  4096
+#define DIR_CACHE_SIZE     1024
+
+#define RING_UNLINK        0
+#define RING_OPEN          1
+#define RING_WRITE         2
+#define RING_CLOSE         3
+
+#define WALK_PENDING       0
+#define WALK_SCANNING      1
+#define WALK_DONE          2
+
+typedef struct decodeentry
+{
+	union
+	{
+		unsigned char symbol[DECODE_SYMBOLS]; // symbols decoded by this entry, in stream order
+		u_int32_t link;                       // first entry of the subtable when count is 0
+	};
+	unsigned char count;       // number of symbols, 0 means link to a subtable
+	unsigned char length;      // bits consumed by all symbols, or bits indexing the subtable
+	unsigned char firstLength; // bits consumed by symbol[0] alone
+} decodeEntry;
+
+typedef struct decodetable
+{
+	decodeEntry* entry;
+	u_int32_t size;
+	u_int32_t capacity;
+} decodeTable;
+
+typedef struct bitreader
+{
+	const unsigned char* buffer;
+	size_t position;
+	size_t length;
+	u_int64_t bitBuffer; // next bits of the stream, most significant bit first
+	int bitCount;
+} bitReader;
+
+typedef struct bitwriter
+{
+	unsigned char* buffer;
+	size_t length;
+	u_int64_t bitBuffer; // pending bits, oldest in the most significant bit
+	int bitCount;
+} bitWriter;
+
+typedef struct pooltask
+{
+	void (*run)(void*);
+	void* argument;
+	int* done;
+} poolTask;
+
+typedef struct threadpool
+{
+	pthread_t* thread;
+	int threadNumber;
+	poolTask* task; // ring of queued tasks
+	int capacity;
+	int head;
+	int count;
+	int stop;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_cond_t finish;
+} threadPool;
+
+typedef struct matchfinder
+{
+	u_int32_t* head; // newest position + 1 per hash, 0 for none
+	u_int32_t* chain; // per position in the block, the previous one + 1 with the same hash
+	unsigned char* stream[LZ_STREAMS];
+	size_t streamLength[LZ_STREAMS];
+	unsigned char* out; // the HF_LZ77 block, used only if it beats plain Huffman
+} matchFinder;
+
+typedef struct blockjob
+{
+	unsigned char* in;
+	size_t inLength;
+	unsigned char* out;
+	size_t outLength;
+	u_int64_t bitLength;
+	matchFinder* finder; // NULL when compressLevel is 0
+	u_int32_t* header; // records of the block that are tar metadata, from scanTar()
+	u_int32_t headerNumber;
+	unsigned char* split; // the header records, then everything else
+	unsigned char* splitOut; // the HF_TAR block before it is checked against storing
+	int done;
+} blockJob;
+
+typedef struct recordring
+{
+	unsigned char* buffer;
+	size_t capacity;
+	size_t head;  // next byte to read
+	size_t count; // bytes buffered
+	int closed;
+	pthread_mutex_t lock;
+	pthread_cond_t notEmpty;
+	pthread_cond_t notFull;
+} recordRing;
+
+typedef struct compresspipe
+{
+	FILE* fin;
+	FILE* fout;
+	int result;
+} compressPipe;
+
+typedef struct blockindex
+{
+	u_int64_t offset;    // block start in the compressed stream
+	u_int64_t length;    // uncompressed bytes
+	u_int64_t bitLength; // payload bits
+} blockIndex;
+
+typedef struct tarscanner
+{
+	u_int64_t position;     // offset of the next record in the tar stream
+	u_int64_t entryStart;   // first record of the coming entry, its long name records included
+	u_int64_t skip;         // records of the last header's data still to pass
+	int pending;            // long name or link records seen for the coming header
+	int collect;            // the records being passed hold the long name
+	int nameData;           // the records being passed are a long name or link name
+	char* longName;
+	u_int64_t longNameSize;
+	u_int64_t longNameLength;
+	int stop;               // end of archive, or not a tar stream
+	unsigned char* member;  // member index: name length, name, entry offset, entry length
+	size_t memberLength;
+	size_t memberCapacity;
+	u_int64_t memberNumber;
+} tarScanner;
+
+typedef struct decodejob
+{
+	const unsigned char* in;
+	size_t inLength;
+	int fout;               // -1 decodes into out for a reader that takes the blocks in order
+	u_int64_t outOffset;
+	unsigned char* out;
+	size_t length;
+	int result;             // 1 for a broken block, 2 when writing it failed, already reported
+	int done;
+} decodeJob;
+
+typedef struct walkentry
+{
+	struct walkentry* next; // next sibling in readdir order
+	struct walkentry* child;
+	char* path;
+	char* linkPath; // symlink target
+	struct stat statBuf;
+	int fd; // opened and read ahead by a scanner, or -1
+	int statError;
+	int linkError;
+	int dirError;
+	int state; // WALK_PENDING until a directory's children are listed
+	int queued; // still referenced by a walk queue
+	int orphan; // archived while queued, freed by whoever dequeues it
+} walkEntry;
+
+typedef struct walkqueue
+{
+	walkEntry** task;
+	size_t head;
+	size_t count;
+	size_t capacity;
+} walkQueue;
+
+typedef struct treewalker
+{
+	walkQueue* queue; // one per scanner, the last one is the writer's
+	int number;
+	pthread_t* thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_cond_t done;
+	u_int64_t pending;
+	int openFiles;
+	int stop;
+} treeWalker;
+
+typedef struct walkworker
+{
+	treeWalker* walker;
+	int id;
+} walkWorker;
+
+typedef struct ioring
+{
+	int fd;
+	unsigned char* sqMap;
+	size_t sqMapLength;
+	unsigned char* cqMap;
+	size_t cqMapLength;
+	struct io_uring_sqe* sqe;
+	size_t sqeLength;
+	unsigned* sqHead;
+	unsigned* sqTail;
+	unsigned sqMask;
+	unsigned sqEntries;
+	unsigned* cqHead;
+	unsigned* cqTail;
+	unsigned cqMask;
+	struct io_uring_cqe* cqe;
+	unsigned toSubmit;
+} ioRing;
+
+typedef struct ringfile
+{
+	char* path;
+	char* buffer;
+	size_t capacity;
+	u_int64_t size;
+	mode_t mode;
+	u_int64_t uid;
+	u_int64_t gid;
+	u_int64_t mTime;
+	u_int32_t hash;
+	int expect; // completions still to come
+	int openResult;
+	int writeResult;
+} ringFile;
+
+typedef struct ringextractor
+{
+	ioRing ring;
+	ringFile file[IO_RING_FILES];
+	int freeSlot[IO_RING_FILES];
+	int freeNumber;
+	unsigned short pathCount[IO_RING_PATH_HASH]; // paths in flight by hash, so a path is never written twice at once
+	int result;
+} ringExtractor;
+
+typedef struct extractfile
+{
+	int fd;
+	mode_t mode;
+	u_int64_t uid;
+	u_int64_t gid;
+	u_int64_t mTime;
+	u_int64_t chunks; // chunks not yet written, the last one applies metadata and closes
+	int failed;
+	int* result;
+} extractFile;
+
+typedef struct extractjob
+{
+	extractFile* file;
+	char* buffer;
+	size_t length;
+	u_int64_t offset;
+	int done;
+} extractJob;
+
+typedef struct dircache
+{
+	char** slot; // directories known to exist, open addressing
+	u_int64_t capacity; // power of two
+	u_int64_t count;
+	char* parent; // directory parentFd refers to
+	int parentFd;
+} dirCache;
+
+typedef struct dirmeta
+{
+	char* path;
+	mode_t mode;
+	u_int64_t uid;
+	u_int64_t gid;
+	u_int64_t mTime;
+	int created; // made by this extraction, so owned by us with the umask applied to 0777
+} dirMeta;
+
+typedef struct untarstate
+{
+	ringExtractor* ring; // small files, NULL without io_uring
+	threadPool* pool; // every other regular file, in IO_BUFFER_SIZE chunks
+	extractJob* job;
+	int window;
+	u_int64_t submitted;
+	dirCache cache;
+	dirMeta* dir; // applied once everything inside has been written
+	u_int64_t dirNumber;
+	u_int64_t dirCapacity;
+	int result;
+} untarState;
+
+linkTable iNodeTable;
 
-linkNode linkNodeHead;
+nameCache userNames; // uid and gid to name, one lookup per id for the whole run
+nameCache groupNames;
 
-u_int64_t Frequency[256] = { 0 };
+int numericOwner = 0; // 1 archives ids only and never asks NSS for names
 
-huffmanItem huffmanTable[256];
+u_int32_t blockSize = BLOCK_SIZE;
+
+int threadNumber = 0; // 0 uses every online CPU
+
+int compressLevel = 1; // 0 is order-0 coding only, 1 to 3 search harder for LZ77 matches
+
+u_int32_t lzWindow = BLOCK_SIZE; // farthest match, blocks stay independent so it never reaches past the block start
+
+int storeThreshold = 97; // percent, a block is stored raw when the sampled order-0 estimate of every segment is above
+
+const int lzChainLength[] = { 0, 8, 48, 256 }; // per compressLevel, candidates tried per position
+const int lzNiceLength[] = { 0, 32, 128, 1024 }; // a match this long stops the search
+const int lzLazy[] = { 0, 0, 1, 1 }; // also try the next position before taking a match
+
+int ioRingEnabled = 1; // 0 keeps untar() on blocking calls
+
+mode_t processUmask; // what untar() creates with, read once so unchanged metadata is not set again
+uid_t processUid;
+gid_t processGid;
 
 char* mallocAndReset(size_t length, int n)
 {
@@ -104,354 +525,830 @@ char* mallocAndReset(size_t length, int n)
 	return p;
 }
 
-int createDir(char* path)
+char* mallocAligned(size_t length)
+{
+	void* p = NULL;
+	if (posix_memalign(&p, IO_ALIGN, length ? length : 1))
+	{
+		perror("posix_memalign error");
+		exit(1);
+	}
+	return (char*)p;
+}
+
+int writeAll(int fd, const char* buffer, size_t length)
 {
-	int pathLength = strlen(path);
-	char* temp = (char*)mallocAndReset(pathLength + 1, 0);
-	strcat(temp, path);
-	for (int i = 0; i < pathLength; i++)
+	while (length)
 	{
-		if (temp[i] == '/')
+		ssize_t n = write(fd, buffer, length);
+		if (n < 0)
 		{
-			temp[i] = '\0';
-			if (access(temp, F_OK))
-			{
-				if (mkdir(temp, 0777))
-				{
-					perror("mkdir error");
-					free(temp);
-					return 1;
-				}
-			}
-			temp[i] = '/';
+			perror("write error");
+			return 1;
 		}
+		buffer += n;
+		length -= n;
 	}
-	free(temp);
 	return 0;
 }
 
-void copyNByte(char* dest, char* src, int n)
+int writeAllAt(int fd, const char* buffer, size_t length, u_int64_t offset)
 {
-	for (int i = 0; i < n; i++) dest[i] = src[i];
+	while (length)
+	{
+		ssize_t n = pwrite(fd, buffer, length, offset);
+		if (n < 0)
+		{
+			perror("write error");
+			return 1;
+		}
+		buffer += n;
+		length -= n;
+		offset += n;
+	}
+	return 0;
 }
 
-char* findAndAddINode(u_int64_t inode, char* path)
+// as much of size bytes of fd as the kernel will move into the archive fd itself,
+// copy_file_range between regular files, sendfile into a pipe or socket, where only
+// whole records go so that every write a reader sees ends on a record boundary,
+// 0 if fout has no fd of its own (a compressor stage) or neither call applies
+u_int64_t sendToArchive(int fd, u_int64_t size, FILE* fout)
 {
-	iNode* p = &iNodeHead;
-	for (u_int64_t i = 0; i < iNodeHead.inode; i++)
+	int outFd = fileno(fout);
+	struct stat statBuf;
+	if (outFd < 0 || !size || fstat(outFd, &statBuf) || fflush(fout)) return 0;
+
+	int useCopy = S_ISREG(statBuf.st_mode);
+	if (!useCopy) size &= ~(u_int64_t)511; // the tail goes with its padding through fout
+	u_int64_t sent = 0;
+	while (sent < size)
 	{
-		p = p->next;
-		if (p->inode == inode) return p->path;
+		size_t want = size - sent < (1 << 30) ? size - sent : (1 << 30);
+		ssize_t n = useCopy ? copy_file_range(fd, NULL, outFd, NULL, want, 0) : sendfile(outFd, fd, NULL, want);
+		if (n < 0 && useCopy && !sent && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
+		{
+			useCopy = 0; // older kernels copy only within one filesystem
+			size &= ~(u_int64_t)511;
+			continue;
+		}
+		if (n <= 0) break; // EOF if the file shrank, anything else falls back to read()
+		sent += n;
 	}
-	iNode* temp = (iNode*)mallocAndReset(sizeof(iNode), 0);
-	temp->inode = inode;
-	temp->path = (char*)mallocAndReset(strlen(path) + 1, 0);
-	copyNByte(temp->path, path, strlen(path));
-	p->next = temp;
-	iNodeHead.inode++;
-	return NULL;
+	return sent;
 }
 
-void freeINode()
+// size bytes of fd into the archive, zero padded to whole records, zero copy where
+// the kernel allows it and in large reads for the rest,
+// a file that shrank meanwhile is padded out to the size already in its header
+int copyToArchive(int fd, u_int64_t size, FILE* fout)
 {
-	for (u_int64_t i = 0; i < iNodeHead.inode; i++)
+	u_int64_t padded = (size + 511) / 512 * 512;
+	u_int64_t sent = sendToArchive(fd, size, fout);
+	padded -= sent;
+	size -= sent;
+	size_t bufferLength = padded < IO_BUFFER_SIZE ? padded : IO_BUFFER_SIZE;
+	char* buffer = mallocAligned(bufferLength);
+	int shrank = 0;
+	while (padded)
 	{
-		iNode* temp = iNodeHead.next;
-		iNodeHead.next = temp->next;
-		free(temp->path);
-		free(temp);
+		size_t want = padded < bufferLength ? padded : bufferLength;
+		size_t got = 0;
+		while (!shrank && got < want && got < size)
+		{
+			ssize_t n = read(fd, buffer + got, (want < size ? want : size) - got);
+			if (n <= 0)
+			{
+				shrank = 1;
+				break;
+			}
+			got += n;
+		}
+		memset(buffer + got, 0, want - got);
+		fwrite(buffer, 1, want, fout);
+		padded -= want;
+		size = size > want ? size - want : 0;
+	}
+	free(buffer);
+	return shrank;
+}
+
+// the whole of a regular file, read only, NULL if it can not be mapped
+unsigned char* mapFile(FILE* fin, size_t* length)
+{
+	struct stat statBuf;
+	if (fstat(fileno(fin), &statBuf) || !S_ISREG(statBuf.st_mode) || !statBuf.st_size) return NULL;
+	void* p = mmap(NULL, statBuf.st_size, PROT_READ, MAP_PRIVATE, fileno(fin), 0);
+	if (p == MAP_FAILED) return NULL;
+	*length = statBuf.st_size;
+	return (unsigned char*)p;
+}
+
+void* poolWorker(void* argument)
+{
+	threadPool* pool = (threadPool*)argument;
+	pthread_mutex_lock(&pool->lock);
+	while (1)
+	{
+		while (!pool->count && !pool->stop) pthread_cond_wait(&pool->wake, &pool->lock);
+		if (!pool->count) break;
+		poolTask task = pool->task[pool->head];
+		pool->head = (pool->head + 1) % pool->capacity;
+		pool->count--;
+		pthread_mutex_unlock(&pool->lock);
+
+		task.run(task.argument);
+
+		pthread_mutex_lock(&pool->lock);
+		if (task.done) *task.done = 1;
+		pthread_cond_broadcast(&pool->finish);
 	}
-	iNodeHead.inode = 0;
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
 }
 
-int addLinkNode(linkNode* tempNode)
+int onlineThreadNumber()
 {
-	linkNode* pre = &linkNodeHead;
-	linkNode* p = pre->next;
-	for (int i = 0; i < linkNodeHead.frequency; i++)
+	if (threadNumber > 0) return threadNumber;
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? n : 1;
+}
+
+threadPool* createThreadPool(int number)
+{
+	threadPool* pool = (threadPool*)mallocAndReset(sizeof(threadPool), 0);
+	pool->capacity = 16;
+	pool->task = (poolTask*)mallocAndReset(pool->capacity * sizeof(poolTask), 0);
+	pool->thread = (pthread_t*)mallocAndReset(number * sizeof(pthread_t), 0);
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->wake, NULL);
+	pthread_cond_init(&pool->finish, NULL);
+	for (int i = 0; i < number; i++)
 	{
-		if (tempNode->frequency < p->frequency)
+		if (pthread_create(pool->thread + i, NULL, poolWorker, pool))
 		{
-			pre->next = tempNode;
-			tempNode->next = p;
-			linkNodeHead.frequency++;
-			return 0;
+			perror("pthread_create error");
+			break;
 		}
-		pre = pre->next;
-		p = pre->next;
+		pool->threadNumber++;
 	}
-	tempNode->next = p;
-	pre->next = tempNode;
-	linkNodeHead.frequency++;
-	return 0;
+	if (!pool->threadNumber) exit(1);
+	return pool;
 }
 
-int generateHuffmanCode(huffmanNode* huffmanTree, unsigned char length, char* code)
+// queue run(argument), *done is set once it has returned
+void submitTask(threadPool* pool, void (*run)(void*), void* argument, int* done)
 {
-	if (huffmanTree->ch != -1)
+	pthread_mutex_lock(&pool->lock);
+	if (pool->count == pool->capacity)
 	{
-		huffmanTable[huffmanTree->ch].huffmanCode = code;
-		huffmanTable[huffmanTree->ch].length = length;
-		return 0;
+		poolTask* task = (poolTask*)mallocAndReset(pool->capacity * 2 * sizeof(poolTask), 0);
+		for (int i = 0; i < pool->count; i++) task[i] = pool->task[(pool->head + i) % pool->capacity];
+		free(pool->task);
+		pool->task = task;
+		pool->head = 0;
+		pool->capacity *= 2;
 	}
-	char* leftHuffmanCode = (char*)mallocAndReset(strlen(code) + 2, 0);
-	char* rightHuffmanCode = (char*)mallocAndReset(strlen(code) + 2, 0);
-	strcat(leftHuffmanCode, code);
-	strcat(leftHuffmanCode, "0");
-	strcat(rightHuffmanCode, code);
-	strcat(rightHuffmanCode, "1");
-	if (generateHuffmanCode(huffmanTree->left, length + 1, leftHuffmanCode)) free(leftHuffmanCode);
-	if (generateHuffmanCode(huffmanTree->right, length + 1, rightHuffmanCode)) free(rightHuffmanCode);
-	return 1;
+	if (done) *done = 0;
+	poolTask* task = pool->task + (pool->head + pool->count) % pool->capacity;
+	task->run = run;
+	task->argument = argument;
+	task->done = done;
+	pool->count++;
+	pthread_cond_signal(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
 }
 
-void copySrcName(char* path, Record* block)
+void waitTask(threadPool* pool, int* done)
 {
-	copyNByte(block->name, path, strlen(path) < 100 ? strlen(path) : 100);
+	pthread_mutex_lock(&pool->lock);
+	while (!*done) pthread_cond_wait(&pool->finish, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
 }
 
-void copyLinkName(char* path, Record* block)
+void freeThreadPool(threadPool* pool)
 {
-	copyNByte(block->link_name, path, strlen(path) < 100 ? strlen(path) : 100);
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+	for (int i = 0; i < pool->threadNumber; i++) pthread_join(pool->thread[i], NULL);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->wake);
+	pthread_cond_destroy(&pool->finish);
+	free(pool->thread);
+	free(pool->task);
+	free(pool);
 }
 
-char* numberToNChar(u_int64_t number, int n)
+void readProcessIdentity()
 {
-	char* temp = (char*)mallocAndReset(n, 0);
-	int i = n - 2;
-	while (i >= 0)
-	{
-		temp[i] = '0' + (number & 0x7);
-		number = number >> 3;
-		i--;
-	}
-	return temp;
+	processUmask = umask(0);
+	umask(processUmask);
+	processUid = geteuid();
+	processGid = getegid();
 }
 
-u_int64_t charToNumber(char* octalString)
+// whether an entry just created by this process needs chown, only root can give files away
+int ownerChanged(u_int64_t uid, u_int64_t gid)
 {
-	u_int64_t temp = 0;
-	int length = strlen(octalString);
-	for (int i = 0; i < length; i++) temp = temp * 8 + (octalString[i] - '0');
-	return temp;
+	return !processUid && (uid != processUid || gid != processGid);
 }
 
-int calculateCheckSum(Record* block)
+// whether an entry just created with created as its mode needs chmod to end up as mode
+int modeChanged(mode_t created, mode_t mode, int chowned)
 {
-	unsigned char* content = (unsigned char*)block;
-	unsigned int sum = 0;
-	for (int i = 0; i < 512; i++) sum += content[i];
-	return sum;
+	return (created & ~processUmask & 07777) != mode || (chowned && (mode & 06000)); // chown drops set-id bits
 }
 
-void printOneBlock(Record* block, FILE* fout)
+u_int64_t hashPrefix(const char* path, size_t length)
 {
-	unsigned char* p = (char*)block;
-	for (int i = 0; i < 512; i++)
-	{
-		Frequency[p[i]]++;
-		fprintf(fout, "%c", p[i]);
-	}
+	u_int64_t h = 14695981039346656037ULL;
+	for (size_t i = 0; i < length; i++) h = (h ^ (unsigned char)path[i]) * 1099511628211ULL;
+	return h;
 }
 
-Record* readOneBlock(FILE* fin)
+// the slot holding the first length bytes of path, or the empty slot where they belong
+char** findDirCache(dirCache* cache, const char* path, size_t length)
 {
-	Record* block = (Record*)mallocAndReset(512, 0);
-	int ch;
-	for (int i = 0; i < 512; i++)
+	u_int64_t mask = cache->capacity - 1;
+	u_int64_t i = hashPrefix(path, length) & mask;
+	while (cache->slot[i] && (strncmp(cache->slot[i], path, length) || cache->slot[i][length])) i = (i + 1) & mask;
+	return &cache->slot[i];
+}
+
+void addDirCache(dirCache* cache, const char* path, size_t length)
+{
+	if ((cache->count + 1) * 2 > cache->capacity)
 	{
-		if ((ch = fgetc(fin)) != EOF) ((char*)block)[i] = ch;
-		else
+		char** old = cache->slot;
+		u_int64_t oldCapacity = cache->capacity;
+		cache->capacity = oldCapacity ? oldCapacity * 2 : DIR_CACHE_SIZE;
+		cache->slot = (char**)mallocAndReset(cache->capacity * sizeof(char*), 0);
+		for (u_int64_t i = 0; i < oldCapacity; i++)
 		{
-			perror("readOneBlock error");
-			return 0;
+			if (old[i]) *findDirCache(cache, old[i], strlen(old[i])) = old[i];
 		}
+		free(old);
 	}
-	return block;
+	char** slot = findDirCache(cache, path, length);
+	if (*slot) return;
+	*slot = (char*)mallocAndReset(length + 1, 0);
+	memcpy(*slot, path, length);
+	cache->count++;
 }
 
-int tarLongName(char* path, FILE* fout, char tarType)
+void freeDirCache(dirCache* cache)
 {
-	int blockNumber = 1 + (strlen(path) + 511) / 512;
-	Record* block = (Record*)mallocAndReset(blockNumber * 512, 0);
+	for (u_int64_t i = 0; i < cache->capacity; i++) free(cache->slot[i]);
+	free(cache->slot);
+	free(cache->parent);
+	if (cache->parent) close(cache->parentFd);
+	memset(cache, 0, sizeof(dirCache));
+}
 
-	copySrcName("././@LongLink", block); // LongName lable
-	copyNByte(block->mode, "0000644", 8);
-	copyNByte(block->uid, "0000000", 8);
-	copyNByte(block->gid, "0000000", 8);
+// an fd for the directory holding path, reused while entries stay in one directory, AT_FDCWD for bare names
+int parentDirFd(dirCache* cache, const char* path)
+{
+	const char* last = strrchr(path, '/');
+	if (!last || last == path) return AT_FDCWD;
+	size_t length = last - path;
+	if (cache->parent && !strncmp(cache->parent, path, length) && !cache->parent[length]) return cache->parentFd;
+	if (cache->parent) close(cache->parentFd);
+	free(cache->parent);
+	cache->parent = (char*)mallocAndReset(length + 1, 0);
+	memcpy(cache->parent, path, length);
+	cache->parentFd = open(cache->parent, O_PATH | O_DIRECTORY);
+	if (cache->parentFd < 0)
+	{
+		free(cache->parent);
+		cache->parent = NULL;
+		return AT_FDCWD;
+	}
+	return cache->parentFd;
+}
 
-	char* tarSize = numberToNChar(strlen(path) + 1, 12);
-	copyNByte(block->size, tarSize, 12);
-	free(tarSize);
+// the name of path inside the directory parentDirFd() returned for it
+const char* baseName(const char* path, int dirFd)
+{
+	return dirFd == AT_FDCWD ? path : strrchr(path, '/') + 1;
+}
 
-	copyNByte(block->mtime, "00000000000", 12);
-	copyNByte(block->check, "\x20\x20\x20\x20\x20\x20\x20\x20", 8);
-	block->type = tarType;
-	copyNByte(block->ustar, "ustar  ", 8);
-	copyNByte(block->owner, "root", 5);
-	copyNByte(block->group, "root", 5);
+// every directory above the last '/' of path, only prefixes not already known are tried,
+// each with a single mkdir, relative to the cached parent fd when it is the direct parent,
+// *created tells whether the deepest one was made here
+int createDir(dirCache* cache, char* path, int* created)
+{
+	if (created) *created = 0;
+	char* last = strrchr(path, '/');
+	if (!last || last == path) return 0;
+	size_t length = last - path;
+	if (cache->capacity && *findDirCache(cache, path, length)) return 0;
 
-	int checkSum = calculateCheckSum(block);
-	char* checkSumChar = numberToNChar(checkSum, 7);
-	copyNByte(block->check, checkSumChar, 7);
-	free(checkSumChar);
+	size_t known = 0; // longest prefix known to exist
+	for (size_t i = length; i > 0; i--)
+	{
+		if ((i == length || path[i] == '/') && cache->capacity && *findDirCache(cache, path, i))
+		{
+			known = i;
+			break;
+		}
+	}
 
-	copyNByte((char*)(block + 1), path, strlen(path));
+	char* temp = (char*)mallocAndReset(length + 1, 0);
+	memcpy(temp, path, length);
+	for (size_t i = known + 1; i <= length; i++)
+	{
+		if (i < length && temp[i] != '/') continue;
+		temp[i] = '\0';
+		int result = 0;
+		char* name = strrchr(temp, '/');
+		if (name && cache->parent && !strncmp(cache->parent, temp, name - temp) && !cache->parent[name - temp])
+		{
+			result = mkdirat(cache->parentFd, name + 1, 0777);
+		}
+		else result = mkdir(temp, 0777);
+		if (result && errno != EEXIST)
+		{
+			perror("mkdir error");
+			free(temp);
+			return 1;
+		}
+		if (created && i == length) *created = !result;
+		addDirCache(cache, temp, i);
+		if (i < length) temp[i] = '/';
+	}
+	free(temp);
+	return 0;
+}
 
-	for (int i = 0; i < blockNumber; i++) printOneBlock(block + i, fout);
+void copyNByte(char* dest, char* src, int n)
+{
+	for (int i = 0; i < n; i++) dest[i] = src[i];
+}
 
-	free(block);
-	return 0;
+u_int64_t hashINode(u_int64_t dev, u_int64_t inode)
+{
+	u_int64_t h = (inode ^ (dev << 32 | dev >> 32)) * 0x9e3779b97f4a7c15ULL;
+	return h ^ (h >> 29);
 }
 
-int tar(char* path, FILE* fout)
+char* addPath(char* path)
 {
-	struct stat statBuf;
-	if (lstat(path, &statBuf))
+	size_t length = strlen(path) + 1;
+	pathChunk* chunk = iNodeTable.chunk;
+	if (chunk && !chunk->live)
 	{
-		printf("%s", path);
-		perror(" stat error");
-		return 1;
+		chunk->used = 0; // every path in it has been released
+		if (chunk->size < length)
+		{
+			iNodeTable.chunk = chunk->next;
+			if (chunk->next) chunk->next->prev = NULL;
+			free(chunk);
+			chunk = NULL;
+		}
 	}
+	if (!chunk || chunk->size - chunk->used < length)
+	{
+		size_t size = length > PATH_CHUNK_SIZE ? length : PATH_CHUNK_SIZE;
+		chunk = (pathChunk*)mallocAndReset(sizeof(pathChunk) + size, 0);
+		chunk->size = size;
+		chunk->next = iNodeTable.chunk;
+		if (chunk->next) chunk->next->prev = chunk;
+		iNodeTable.chunk = chunk;
+	}
+	char* p = chunk->data + chunk->used;
+	memcpy(p, path, length);
+	chunk->used += length;
+	chunk->live++;
+	return p;
+}
 
-	Record* block = (Record*)mallocAndReset(512, 0);
-
-	copyNByte(block->mode, "0000000", 8);
-
-	block->mode[3] = ((007000 & statBuf.st_mode) >> 9) + '0';
-	block->mode[4] = ((000700 & statBuf.st_mode) >> 6) + '0';
-	block->mode[5] = ((000070 & statBuf.st_mode) >> 3) + '0';
-	block->mode[6] = (000007 & statBuf.st_mode) + '0';
+void releasePath(pathChunk* chunk)
+{
+	if (--chunk->live || chunk == iNodeTable.chunk) return;
+	if (chunk->prev) chunk->prev->next = chunk->next;
+	if (chunk->next) chunk->next->prev = chunk->prev;
+	iNodeTable.retired = chunk;
+}
 
-	char* tarUID = numberToNChar(statBuf.st_uid, 8);
-	char* tarGID = numberToNChar(statBuf.st_gid, 8);
-	copyNByte(block->uid, tarUID, 8);
-	copyNByte(block->gid, tarGID, 8);
-	free(tarUID);
-	free(tarGID);
+void growINodeTable()
+{
+	iNode* old = iNodeTable.slot;
+	u_int64_t oldCapacity = iNodeTable.capacity;
+	iNodeTable.capacity = oldCapacity ? oldCapacity * 2 : LINK_TABLE_SIZE;
+	iNodeTable.slot = (iNode*)mallocAndReset(iNodeTable.capacity * sizeof(iNode), 0);
+	u_int64_t mask = iNodeTable.capacity - 1;
+	for (u_int64_t i = 0; i < oldCapacity; i++)
+	{
+		if (!old[i].inode) continue;
+		u_int64_t j = hashINode(old[i].dev, old[i].inode) & mask;
+		while (iNodeTable.slot[j].inode) j = (j + 1) & mask;
+		iNodeTable.slot[j] = old[i];
+	}
+	free(old);
+}
 
-	char* tarMTime = numberToNChar(statBuf.st_mtime, 12);
-	copyNByte(block->mtime, tarMTime, 12);
-	free(tarMTime);
+// backward shift deletion, so lookups never need tombstones
+void removeINode(u_int64_t i)
+{
+	u_int64_t mask = iNodeTable.capacity - 1;
+	releasePath(iNodeTable.slot[i].chunk);
+	for (u_int64_t j = (i + 1) & mask; iNodeTable.slot[j].inode; j = (j + 1) & mask)
+	{
+		u_int64_t home = hashINode(iNodeTable.slot[j].dev, iNodeTable.slot[j].inode) & mask;
+		if (((j - home) & mask) < ((j - i) & mask)) continue; // j can not move back past its home
+		iNodeTable.slot[i] = iNodeTable.slot[j];
+		i = j;
+	}
+	iNodeTable.slot[i].inode = 0;
+	iNodeTable.count--;
+}
 
-	copyNByte(block->check, "\x20\x20\x20\x20\x20\x20\x20\x20", 8);
+// the path first archived for (dev, inode), or NULL after remembering path for it,
+// the entry is dropped once all links have been seen and the returned path
+// stays valid until the next call
+char* findAndAddINode(u_int64_t dev, u_int64_t inode, u_int64_t links, char* path)
+{
+	free(iNodeTable.retired);
+	iNodeTable.retired = NULL;
+	if (!inode) return NULL; // 0 is the empty slot marker and never a real inode
 
-	if (S_ISREG(statBuf.st_mode)) block->type = NORMAL;
-	else if (S_ISDIR(statBuf.st_mode)) block->type = DIRECTORY;
-	else if (S_ISCHR(statBuf.st_mode)) block->type = CHAR;
-	else if (S_ISBLK(statBuf.st_mode)) block->type = BLOCK;
-	else if (S_ISLNK(statBuf.st_mode)) block->type = SYMLINK;
-	else if (S_ISFIFO(statBuf.st_mode)) block->type = FIFO;
+	if ((iNodeTable.count + 1) * 10 > iNodeTable.capacity * 7) growINodeTable();
+	u_int64_t mask = iNodeTable.capacity - 1;
+	u_int64_t i = hashINode(dev, inode) & mask;
+	for (; iNodeTable.slot[i].inode; i = (i + 1) & mask)
+	{
+		iNode* p = &iNodeTable.slot[i];
+		if (p->inode != inode || p->dev != dev) continue;
+		char* found = p->path;
+		if (!--p->links) removeINode(i);
+		return found;
+	}
+	iNodeTable.slot[i].dev = dev;
+	iNodeTable.slot[i].inode = inode;
+	iNodeTable.slot[i].links = links - 1;
+	iNodeTable.slot[i].path = addPath(path);
+	iNodeTable.slot[i].chunk = iNodeTable.chunk;
+	iNodeTable.count++;
+	return NULL;
+}
 
-	if (S_ISCHR(statBuf.st_mode) || S_ISBLK(statBuf.st_mode))
+idName* findIdName(nameCache* cache, u_int64_t id)
+{
+	if ((cache->count + 1) * 2 > cache->capacity)
 	{
-		char* major = numberToNChar(MAJOR(statBuf.st_rdev), 8);
-		char* minor = numberToNChar(MINOR(statBuf.st_rdev), 8);
-		copyNByte(block->major, major, 8);
-		copyNByte(block->minor, minor, 8);
-		free(major);
-		free(minor);
+		idName* old = cache->slot;
+		u_int64_t oldCapacity = cache->capacity;
+		cache->capacity = oldCapacity ? oldCapacity * 2 : NAME_CACHE_SIZE;
+		cache->slot = (idName*)mallocAndReset(cache->capacity * sizeof(idName), 0);
+		for (u_int64_t i = 0; i < oldCapacity; i++)
+		{
+			if (!old[i].used) continue;
+			u_int64_t j = hashINode(0, old[i].id) & (cache->capacity - 1);
+			while (cache->slot[j].used) j = (j + 1) & (cache->capacity - 1);
+			cache->slot[j] = old[i];
+		}
+		free(old);
 	}
+	u_int64_t mask = cache->capacity - 1;
+	u_int64_t i = hashINode(0, id) & mask;
+	while (cache->slot[i].used && cache->slot[i].id != id) i = (i + 1) & mask;
+	return &cache->slot[i];
+}
 
-	copyNByte(block->ustar, "ustar  ", 8);
+// names longer than the 32 byte field are cut, a NULL name is remembered as empty
+void seedIdName(nameCache* cache, u_int64_t id, const char* name)
+{
+	idName* p = findIdName(cache, id);
+	if (!p->used) cache->count++;
+	p->id = id;
+	p->used = 1;
+	memset(p->name, 0, sizeof(p->name));
+	if (name) strncpy(p->name, name, sizeof(p->name) - 1);
+}
 
-	struct passwd* userInfo = NULL;
-	userInfo = getpwuid(statBuf.st_uid);
-	copyNByte(block->owner, userInfo->pw_name, strlen(userInfo->pw_name));
+// name for the owner/group field, "" when numericOwner is set or the id has none
+char* lookupIdName(nameCache* cache, u_int64_t id, int group)
+{
+	static char none[1];
+	if (numericOwner) return none;
+	idName* p = findIdName(cache, id);
+	if (p->used) return p->name;
+	if (group)
+	{
+		struct group* groupInfo = getgrgid(id);
+		seedIdName(cache, id, groupInfo ? groupInfo->gr_name : NULL);
+	}
+	else
+	{
+		struct passwd* userInfo = getpwuid(id);
+		seedIdName(cache, id, userInfo ? userInfo->pw_name : NULL);
+	}
+	return findIdName(cache, id)->name;
+}
 
-	struct group* groupInfo = NULL;
-	groupInfo = getgrgid(statBuf.st_gid);
-	copyNByte(block->group, groupInfo->gr_name, strlen(groupInfo->gr_name));
+void freeNameCache(nameCache* cache)
+{
+	free(cache->slot);
+	memset(cache, 0, sizeof(nameCache));
+}
 
-	if (S_ISDIR(statBuf.st_mode))
+void freeINode()
+{
+	while (iNodeTable.chunk)
 	{
-		if (strcmp("/", path))
-		{
-			char* dirPath = (char*)mallocAndReset(strlen(path) + 2, 0);
-			if (path[0] == '/') strcat(dirPath, path + 1);
-			else strcat(dirPath, path);
-			strcat(dirPath, "/");
+		pathChunk* temp = iNodeTable.chunk;
+		iNodeTable.chunk = temp->next;
+		free(temp);
+	}
+	free(iNodeTable.retired);
+	free(iNodeTable.slot);
+	memset(&iNodeTable, 0, sizeof(linkTable));
+}
+
+int compareLeaf(const void* a, const void* b)
+{
+	u_int64_t x = *(const u_int64_t*)a;
+	u_int64_t y = *(const u_int64_t*)b;
+	return x < y ? -1 : x > y;
+}
 
-			if (strlen(dirPath) > 100)
+// optimal lengths of at most HUFFMAN_MAX_LENGTH by package-merge, leaf is frequency << 8 | symbol in ascending order
+int limitHuffmanLength(huffmanContext* context, const u_int64_t* leaf, int n)
+{
+	short item[HUFFMAN_MAX_LENGTH][512]; // per level, a leaf index or -1 for a package of two items of the level below
+	int size[HUFFMAN_MAX_LENGTH];
+	u_int64_t weight[512];
+	u_int64_t merged[512];
+
+	for (int i = 0; i < n; i++)
+	{
+		weight[i] = leaf[i] >> 8;
+		item[HUFFMAN_MAX_LENGTH - 1][i] = i;
+	}
+	size[HUFFMAN_MAX_LENGTH - 1] = n;
+	for (int level = HUFFMAN_MAX_LENGTH - 2; level >= 0; level--)
+	{
+		int packages = size[level + 1] / 2;
+		int k = 0;
+		for (int i = 0, j = 0; i < n || j < packages;)
+		{
+			u_int64_t package = j < packages ? weight[2 * j] + weight[2 * j + 1] : 0;
+			if (j == packages || (i < n && leaf[i] >> 8 <= package))
 			{
-				tarLongName(dirPath, fout, LONGNAME);
+				merged[k] = leaf[i] >> 8;
+				item[level][k++] = i++;
+			}
+			else
+			{
+				merged[k] = package;
+				item[level][k++] = -1;
+				j++;
 			}
+		}
+		size[level] = k;
+		memcpy(weight, merged, k * sizeof(u_int64_t));
+	}
+
+	// the cheapest 2n - 2 items of the top level, every time a leaf is taken its code gets one bit longer
+	for (int i = 0; i < n; i++) context->table[leaf[i] & 0xff].length = 0;
+	int take = 2 * n - 2;
+	for (int level = 0; level < HUFFMAN_MAX_LENGTH && take; level++)
+	{
+		int packages = 0;
+		for (int i = 0; i < take; i++)
+		{
+			if (item[level][i] < 0) packages++;
+			else context->table[leaf[item[level][i]] & 0xff].length++;
+		}
+		take = 2 * packages;
+	}
+	return 0;
+}
+
+int canonicalHuffmanCode(huffmanContext* context)
+{
+	huffmanItem* table = context->table;
+	u_int32_t count[HUFFMAN_MAX_LENGTH + 1] = { 0 };
+	u_int32_t nextCode[HUFFMAN_MAX_LENGTH + 1] = { 0 };
+	for (int i = 0; i < 256; i++) count[table[i].length]++;
+	count[0] = 0;
+	for (int length = 1; length <= HUFFMAN_MAX_LENGTH; length++) nextCode[length] = (nextCode[length - 1] + count[length - 1]) << 1;
+	for (int i = 0; i < 256; i++)
+	{
+		if (table[i].length) table[i].huffmanCode = nextCode[table[i].length]++;
+	}
+	return 0;
+}
 
-			copySrcName(dirPath, block);
+void copySrcName(char* path, Record* block)
+{
+	copyNByte(block->name, path, strlen(path) < 100 ? strlen(path) : 100);
+}
 
-			char* tarSize = numberToNChar(0, 12);
-			copyNByte(block->size, tarSize, 12);
-			free(tarSize);
+void copyLinkName(char* path, Record* block)
+{
+	copyNByte(block->link_name, path, strlen(path) < 100 ? strlen(path) : 100);
+}
 
-			int checkSum = calculateCheckSum(block);
-			char* checkSumChar = numberToNChar(checkSum, 7);
-			copyNByte(block->check, checkSumChar, 7);
-			free(checkSumChar);
+const char octalPair[] = "00010203040506071011121314151617202122232425262730313233343536374041424344454647505152535455565760616263646566677071727374757677"; // the two octal digits of 0 to 077
 
-			printOneBlock(block, fout);
+// number as n - 1 zero padded octal digits and a NUL straight into a header field, two digits per lookup
+void putOctal(char* field, u_int64_t number, int n)
+{
+	int i = n - 2;
+	for (; i > 0; i -= 2)
+	{
+		memcpy(field + i - 1, octalPair + 2 * (number & 077), 2);
+		number >>= 6;
+	}
+	if (!i) field[0] = '0' + (number & 7);
+	field[n - 1] = '\0';
+}
 
-			free(dirPath);
-		}
+u_int64_t charToNumber(char* octalString)
+{
+	u_int64_t temp = 0;
+	int length = strlen(octalString);
+	for (int i = 0; i < length; i++) temp = temp * 8 + (octalString[i] - '0');
+	return temp;
+}
 
-		DIR* dirPoint = opendir(path);
-		if (!dirPoint)
-		{
-			printf("%s", path);
-			perror(" open directory error");
-			return 1;
-		}
-		struct dirent* dirSata;
-		while (dirSata = readdir(dirPoint))
+// octal field of at most n characters, leading spaces allowed, ends at the first non octal character
+u_int64_t parseOctal(const char* field, int n)
+{
+	u_int64_t temp = 0;
+	int i = 0;
+	while (i < n && field[i] == ' ') i++;
+	for (; i < n && field[i] >= '0' && field[i] <= '7'; i++) temp = temp * 8 + (field[i] - '0');
+	return temp;
+}
+
+// bytes summed eight at a time in 16-bit lanes, 64 words can not overflow a lane
+int calculateCheckSum(Record* block)
+{
+	const unsigned char* content = (const unsigned char*)block;
+	u_int64_t lanes = 0;
+	for (int i = 0; i < 512; i += 8)
+	{
+		u_int64_t word;
+		memcpy(&word, content + i, 8);
+		lanes += (word & 0x00ff00ff00ff00ffULL) + ((word >> 8) & 0x00ff00ff00ff00ffULL);
+	}
+	lanes = (lanes & 0x0000ffff0000ffffULL) + ((lanes >> 16) & 0x0000ffff0000ffffULL);
+	return (lanes + (lanes >> 32)) & 0xffffffff;
+}
+
+void printOneBlock(Record* block, FILE* fout)
+{
+	fwrite(block, 1, 512, fout);
+}
+
+Record* readOneBlock(FILE* fin)
+{
+	Record* block = (Record*)mallocAndReset(512, 0);
+	if (fread(block, 1, 512, fin) != 512)
+	{
+		perror("readOneBlock error");
+		free(block);
+		return 0;
+	}
+	return block;
+}
+
+int tarLongName(char* path, FILE* fout, char tarType)
+{
+	static const char zero[512];
+	size_t length = strlen(path);
+	Record record;
+	Record* block = &record;
+	memset(block, 0, 512);
+
+	copySrcName("././@LongLink", block); // LongName lable
+	copyNByte(block->mode, "0000644", 8);
+	copyNByte(block->uid, "0000000", 8);
+	copyNByte(block->gid, "0000000", 8);
+
+	putOctal(block->size, length + 1, 12);
+
+	copyNByte(block->mtime, "00000000000", 12);
+	copyNByte(block->check, "\x20\x20\x20\x20\x20\x20\x20\x20", 8);
+	block->type = tarType;
+	copyNByte(block->ustar, "ustar  ", 8);
+	copyNByte(block->owner, "root", 5);
+	copyNByte(block->group, "root", 5);
+
+	putOctal(block->check, calculateCheckSum(block), 7);
+
+	printOneBlock(block, fout);
+	fwrite(path, 1, length, fout);
+	fwrite(zero, 1, (length + 1 + 511) / 512 * 512 - length, fout); // the name's NUL and the record padding
+	return 0;
+}
+
+// the header of one walked entry, and the body of a regular file
+int tarOneEntry(walkEntry* entry, FILE* fout)
+{
+	char* path = entry->path;
+	struct stat statBuf = entry->statBuf;
+
+	if (S_ISLNK(statBuf.st_mode) && entry->linkError)
+	{
+		printf("%s", path);
+		errno = entry->linkError;
+		perror(" readlink error");
+		return 1;
+	}
+
+	Record record;
+	Record* block = &record;
+	memset(block, 0, 512);
+
+	copyNByte(block->mode, "0000000", 8);
+
+	block->mode[3] = ((007000 & statBuf.st_mode) >> 9) + '0';
+	block->mode[4] = ((000700 & statBuf.st_mode) >> 6) + '0';
+	block->mode[5] = ((000070 & statBuf.st_mode) >> 3) + '0';
+	block->mode[6] = (000007 & statBuf.st_mode) + '0';
+
+	putOctal(block->uid, statBuf.st_uid, 8);
+	putOctal(block->gid, statBuf.st_gid, 8);
+	putOctal(block->mtime, statBuf.st_mtime, 12);
+
+	copyNByte(block->check, "\x20\x20\x20\x20\x20\x20\x20\x20", 8);
+
+	if (S_ISREG(statBuf.st_mode)) block->type = NORMAL;
+	else if (S_ISDIR(statBuf.st_mode)) block->type = DIRECTORY;
+	else if (S_ISCHR(statBuf.st_mode)) block->type = CHAR;
+	else if (S_ISBLK(statBuf.st_mode)) block->type = BLOCK;
+	else if (S_ISLNK(statBuf.st_mode)) block->type = SYMLINK;
+	else if (S_ISFIFO(statBuf.st_mode)) block->type = FIFO;
+
+	if (S_ISCHR(statBuf.st_mode) || S_ISBLK(statBuf.st_mode))
+	{
+		putOctal(block->major, MAJOR(statBuf.st_rdev), 8);
+		putOctal(block->minor, MINOR(statBuf.st_rdev), 8);
+	}
+
+	copyNByte(block->ustar, "ustar  ", 8);
+
+	char* owner = lookupIdName(&userNames, statBuf.st_uid, 0);
+	copyNByte(block->owner, owner, strlen(owner));
+
+	char* group = lookupIdName(&groupNames, statBuf.st_gid, 1);
+	copyNByte(block->group, group, strlen(group));
+
+	if (S_ISDIR(statBuf.st_mode))
+	{
+		if (strcmp("/", path))
 		{
-			if (!strcmp(".", dirSata->d_name) || !strcmp("..", dirSata->d_name)) continue;
-			char* nextPath = (char*)mallocAndReset(strlen(path) + strlen(dirSata->d_name) + 2, 0);
-			strcat(nextPath, path);
-			if (strcmp("/", path)) strcat(nextPath, "/"); // if dir is "/" don't add /
-			strcat(nextPath, dirSata->d_name);
-			tar(nextPath, fout);
-			free(nextPath);
+			char* name = path[0] == '/' ? path + 1 : path;
+			size_t length = strlen(name);
+			if (length + 1 > 100) // only a long name needs the trailing '/' as a separate string
+			{
+				char* dirPath = (char*)mallocAndReset(length + 2, 0);
+				memcpy(dirPath, name, length);
+				dirPath[length] = '/';
+				tarLongName(dirPath, fout, LONGNAME);
+				free(dirPath);
+			}
+
+			memcpy(block->name, name, length < 100 ? length : 100);
+			if (length < 100) block->name[length] = '/';
+
+			putOctal(block->size, 0, 12);
+			putOctal(block->check, calculateCheckSum(block), 7);
+
+			printOneBlock(block, fout);
 		}
-		closedir(dirPoint);
 	}
 	else
 	{
-		char* tarSize = NULL;
+		u_int64_t tarSize = statBuf.st_size;
 		if (S_ISLNK(statBuf.st_mode))
 		{
-			char* linkPath = (char*)mallocAndReset(5000, 0);
-			if (-1 == readlink(path, linkPath, 5000))
-			{
-				printf("%s", path);
-				perror(" readlink error");
-				return 1;
-			}
+			char* linkPath = entry->linkPath;
 			if (strlen(linkPath) > 100) tarLongName(linkPath, fout, LINKLONG);
 			copyLinkName(linkPath, block);
-			free(linkPath);
-			tarSize = numberToNChar(0, 12);
-		}
-		else
-		{
-			tarSize = numberToNChar(statBuf.st_size, 12);
+			tarSize = 0;
 		}
 
 		char* hardLinkPath = NULL;
 		if (statBuf.st_nlink > 1)
 		{
-			if (path[0] == '/') hardLinkPath = findAndAddINode(statBuf.st_ino, path + 1);
-			else hardLinkPath = findAndAddINode(statBuf.st_ino, path);
+			if (path[0] == '/') hardLinkPath = findAndAddINode(statBuf.st_dev, statBuf.st_ino, statBuf.st_nlink, path + 1);
+			else hardLinkPath = findAndAddINode(statBuf.st_dev, statBuf.st_ino, statBuf.st_nlink, path);
 			if (hardLinkPath)
 			{
 				block->type = HARDLINK;
 				if (strlen(hardLinkPath) > 100) tarLongName(hardLinkPath, fout, LINKLONG);
 				copyLinkName(hardLinkPath, block);
-				if (tarSize) free(tarSize);
-				tarSize = numberToNChar(0, 12);
+				tarSize = 0;
 			}
 		}
 
-		copyNByte(block->size, tarSize, 12);
-		free(tarSize);
+		putOctal(block->size, tarSize, 12);
 
 		if (path[0] == '/')
 		{
@@ -464,464 +1361,3042 @@ int tar(char* path, FILE* fout)
 			copySrcName(path, block);
 		}
 
-		int checkSum = calculateCheckSum(block);
-		char* checkSumChar = numberToNChar(checkSum, 7);
-		copyNByte(block->check, checkSumChar, 7);
-		free(checkSumChar);
+		putOctal(block->check, calculateCheckSum(block), 7);
 
 		printOneBlock(block, fout);
 
 		if (S_ISREG(statBuf.st_mode) && !hardLinkPath)
 		{
-			int blockNumber = (statBuf.st_size + 511) / 512;
-
-			FILE* fin = fopen(path, "rb");
+			int fd = entry->fd >= 0 ? entry->fd : open(path, O_RDONLY);
 
-			if (!fin)
+			if (fd < 0)
 			{
-				perror("fopen");
+				perror("open");
 				return 1;
 			}
+			posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
 
-			char* content = (char*)block;
-			int ch;
-
-			for (int i = 0; i < blockNumber; i++)
+			if (copyToArchive(fd, statBuf.st_size, fout))
 			{
-				memset(block, 0, 512);
-				for (int i = 0; i < 512; i++)
-				{
-					if ((ch = fgetc(fin)) != EOF) content[i] = ch;
-					else break;
-				}
-				printOneBlock(block, fout);
+				printf("%s", path);
+				printf(" file shrank while being archived\n");
 			}
 
-			fclose(fin);
+			if (fd != entry->fd) close(fd);
 		}
 	}
 
-	free(block);
 	return 0;
 }
 
-int freeSpace(char* srcPath, char* linkPath, Record* block)
+void pushWalkTask(treeWalker* walker, int id, walkEntry* entry)
 {
-	if (srcPath) free(srcPath);
-	if (linkPath) free(linkPath);
-	if (block) free(block);
-	return 0;
+	walkQueue* queue = &walker->queue[id];
+	if (queue->count == queue->capacity)
+	{
+		size_t capacity = queue->capacity ? queue->capacity * 2 : 64;
+		walkEntry** task = (walkEntry**)mallocAndReset(capacity * sizeof(walkEntry*), 0);
+		for (size_t i = 0; i < queue->count; i++) task[i] = queue->task[(queue->head + i) % queue->capacity];
+		free(queue->task);
+		queue->task = task;
+		queue->head = 0;
+		queue->capacity = capacity;
+	}
+	queue->task[(queue->head + queue->count++) % queue->capacity] = entry;
+	entry->queued = 1;
 }
 
-int untar(FILE* fin)
+// the newest directory of queue id, or the oldest of another queue, under walker->lock
+walkEntry* takeWalkTask(treeWalker* walker, int id)
 {
-	while (1)
+	walkQueue* queue = &walker->queue[id];
+	if (queue->count) return queue->task[(queue->head + --queue->count) % queue->capacity];
+	for (int i = 1; i <= walker->number; i++)
 	{
-		Record* tarHead = readOneBlock(fin);
-		char* linkPath = NULL;
-		char* srcPath = NULL;
+		queue = &walker->queue[(id + i) % (walker->number + 1)];
+		if (!queue->count) continue;
+		walkEntry* entry = queue->task[queue->head];
+		queue->head = (queue->head + 1) % queue->capacity;
+		queue->count--;
+		return entry;
+	}
+	return NULL;
+}
 
-		if (tarHead->name[0] == '\0')
-		{
-			freeSpace(srcPath, linkPath, tarHead);
-			return 0;
-		}
+void freeWalkMemory(walkEntry* entry)
+{
+	free(entry->path);
+	free(entry->linkPath);
+	free(entry);
+}
 
-		if (tarHead->type == LINKLONG)
+// the target of the symlink name in dirFd, allocated to fit, NULL with *error set if it can not be read
+char* readLinkAt(int dirFd, const char* name, int* error)
+{
+	char buffer[PATH_MAX];
+	ssize_t n = readlinkat(dirFd, name, buffer, sizeof(buffer));
+	if (n < 0)
+	{
+		*error = errno;
+		return NULL;
+	}
+	char* linkPath = (char*)mallocAndReset(n + 1, 0);
+	memcpy(linkPath, buffer, n);
+	return linkPath;
+}
+
+// the children of dir listed and stat'ed, regular files opened and read ahead
+// while the budget lasts, subdirectories queued on queue id
+void scanWalkEntry(treeWalker* walker, walkEntry* dir, int id)
+{
+	walkEntry* first = NULL;
+	walkEntry** last = &first;
+	u_int64_t count = 0;
+	size_t dirNumber = 0;
+
+	int dirFd = open(dir->path, O_RDONLY | O_DIRECTORY);
+	DIR* dirPoint = dirFd < 0 ? NULL : fdopendir(dirFd);
+	if (!dirPoint)
+	{
+		dir->dirError = errno;
+		if (dirFd >= 0) close(dirFd);
+	}
+	struct dirent* dirSata;
+	while (dirPoint && (dirSata = readdir(dirPoint)))
+	{
+		if (!strcmp(".", dirSata->d_name) || !strcmp("..", dirSata->d_name)) continue;
+		walkEntry* entry = (walkEntry*)mallocAndReset(sizeof(walkEntry), 0);
+		entry->fd = -1;
+		entry->path = (char*)mallocAndReset(strlen(dir->path) + strlen(dirSata->d_name) + 2, 0);
+		strcat(entry->path, dir->path);
+		if (strcmp("/", dir->path)) strcat(entry->path, "/"); // if dir is "/" don't add /
+		strcat(entry->path, dirSata->d_name);
+
+		if (fstatat(dirFd, dirSata->d_name, &entry->statBuf, AT_SYMLINK_NOFOLLOW)) entry->statError = errno;
+		else if (S_ISLNK(entry->statBuf.st_mode))
 		{
-			if (strcmp("././@LongLink", tarHead->name))
-			{
-				printf("tarHead linkName error\n");
-				freeSpace(srcPath, linkPath, tarHead);
-				return 1;
-			}
-			u_int64_t linkNameSize = charToNumber(tarHead->size);
-			int linkNameBlock = (linkNameSize + 511) / 512;
-			linkPath = (char*)mallocAndReset(linkNameSize, 0);
-			int ch;
-			for (int i = 0; i < 512 * linkNameBlock; i++)
-			{
-				if ((ch = fgetc(fin)) != EOF)
-				{
-					if (i < linkNameSize) linkPath[i] = ch;
-				}
-				else
-				{
-					perror("untar-linkName");
-					freeSpace(srcPath, linkPath, tarHead);
-					return 1;
-				}
-			}
-			free(tarHead);
-			tarHead = readOneBlock(fin);
+			entry->linkPath = readLinkAt(dirFd, dirSata->d_name, &entry->linkError);
 		}
-
-		if (tarHead->type == LONGNAME)
+		else if (S_ISDIR(entry->statBuf.st_mode)) dirNumber++;
+		else if (S_ISREG(entry->statBuf.st_mode) && entry->statBuf.st_size)
 		{
-			if (strcmp("././@LongLink", tarHead->name))
-			{
-				printf("tarHead linkName error\n");
-				freeSpace(srcPath, linkPath, tarHead);
-				return 1;
-			}
-			u_int64_t srcNameSize = charToNumber(tarHead->size);
-			int srcNameBlock = (srcNameSize + 511) / 512;
-			srcPath = (char*)mallocAndReset(srcNameSize, 0);
-			int ch;
-			for (int i = 0; i < 512 * srcNameBlock; i++)
+			if (__atomic_add_fetch(&walker->openFiles, 1, __ATOMIC_RELAXED) <= WALK_OPEN_FILES
+				&& (entry->fd = openat(dirFd, dirSata->d_name, O_RDONLY | O_NOCTTY)) >= 0)
 			{
-				if ((ch = fgetc(fin)) != EOF)
-				{
-					if (i < srcNameSize) srcPath[i] = ch;
-				}
-				else
-				{
-					perror("untar-srcName");
-					freeSpace(srcPath, linkPath, tarHead);
-					return 1;
-				}
+				if (entry->statBuf.st_size <= WALK_PREFETCH_SIZE) posix_fadvise(entry->fd, 0, 0, POSIX_FADV_WILLNEED);
 			}
-			free(tarHead);
-			tarHead = readOneBlock(fin);
+			else __atomic_sub_fetch(&walker->openFiles, 1, __ATOMIC_RELAXED);
 		}
+		*last = entry;
+		last = &entry->next;
+		count++;
+	}
+	if (dirPoint) closedir(dirPoint);
 
-		if (srcPath)
+	walkEntry** dirs = (walkEntry**)mallocAndReset((dirNumber ? dirNumber : 1) * sizeof(walkEntry*), 0);
+	size_t n = 0;
+	for (walkEntry* entry = first; entry; entry = entry->next)
+	{
+		if (!entry->statError && S_ISDIR(entry->statBuf.st_mode)) dirs[n++] = entry;
+	}
+
+	pthread_mutex_lock(&walker->lock);
+	dir->child = first;
+	dir->state = WALK_DONE;
+	__atomic_add_fetch(&walker->pending, count, __ATOMIC_RELAXED);
+	while (n) pushWalkTask(walker, id, dirs[--n]); // the first subdirectory ends up newest
+	if (dirNumber) pthread_cond_broadcast(&walker->wake);
+	pthread_cond_broadcast(&walker->done);
+	pthread_mutex_unlock(&walker->lock);
+	free(dirs);
+}
+
+void* walkThread(void* argument)
+{
+	walkWorker* worker = (walkWorker*)argument;
+	treeWalker* walker = worker->walker;
+	walkEntry* entry = NULL;
+	pthread_mutex_lock(&walker->lock);
+	for (;;)
+	{
+		while (!walker->stop && (__atomic_load_n(&walker->pending, __ATOMIC_RELAXED) > WALK_PENDING_LIMIT || !(entry = takeWalkTask(walker, worker->id))))
 		{
-			if (strncmp(tarHead->name, srcPath, 100))
-			{
-				printf("srcName bupipei\n");
-				freeSpace(srcPath, linkPath, tarHead);
-				return 1;
-			}
+			pthread_cond_wait(&walker->wake, &walker->lock);
 		}
-		else
+		if (walker->stop) break;
+		entry->queued = 0;
+		if (entry->orphan) freeWalkMemory(entry);
+		else if (entry->state == WALK_PENDING)
 		{
-			srcPath = (char*)mallocAndReset(101, 0);
-			copyNByte(srcPath, tarHead->name, 100);
+			entry->state = WALK_SCANNING;
+			pthread_mutex_unlock(&walker->lock);
+			scanWalkEntry(walker, entry, worker->id);
+			pthread_mutex_lock(&walker->lock);
 		}
+	}
+	pthread_mutex_unlock(&walker->lock);
+	return NULL;
+}
 
-		if (linkPath)
-		{
-			if (strncmp(tarHead->link_name, linkPath, 100))
-			{
-				printf("linkName bupipei\n");
-				freeSpace(srcPath, linkPath, tarHead);
-				return 1;
-			}
-		}
-		else
+// the children of dir, scanned here if no scanner has claimed it yet
+void waitWalkEntry(treeWalker* walker, walkEntry* dir)
+{
+	pthread_mutex_lock(&walker->lock);
+	if (dir->state == WALK_PENDING)
+	{
+		dir->state = WALK_SCANNING;
+		pthread_mutex_unlock(&walker->lock);
+		scanWalkEntry(walker, dir, walker->number);
+		return;
+	}
+	while (dir->state != WALK_DONE) pthread_cond_wait(&walker->done, &walker->lock);
+	pthread_mutex_unlock(&walker->lock);
+}
+
+void freeWalkEntry(treeWalker* walker, walkEntry* entry)
+{
+	if (entry->fd >= 0)
+	{
+		close(entry->fd);
+		__atomic_sub_fetch(&walker->openFiles, 1, __ATOMIC_RELAXED);
+	}
+	int wake = __atomic_sub_fetch(&walker->pending, 1, __ATOMIC_RELAXED) == WALK_PENDING_LIMIT;
+	if (!S_ISDIR(entry->statBuf.st_mode) && !wake)
+	{
+		freeWalkMemory(entry); // only directories are ever queued
+		return;
+	}
+	pthread_mutex_lock(&walker->lock);
+	if (wake) pthread_cond_broadcast(&walker->wake);
+	int queued = entry->queued;
+	entry->orphan = queued;
+	pthread_mutex_unlock(&walker->lock);
+	if (!queued) freeWalkMemory(entry);
+}
+
+// entry and everything below it in readdir order, as the sequential walk wrote it
+int writeWalkEntry(treeWalker* walker, walkEntry* entry, FILE* fout)
+{
+	if (entry->statError)
+	{
+		printf("%s", entry->path);
+		errno = entry->statError;
+		perror(" stat error");
+		return 1;
+	}
+	int result = tarOneEntry(entry, fout);
+	if (!S_ISDIR(entry->statBuf.st_mode)) return result;
+
+	waitWalkEntry(walker, entry);
+	if (entry->dirError)
+	{
+		printf("%s", entry->path);
+		errno = entry->dirError;
+		perror(" open directory error");
+		result = 1;
+	}
+	walkEntry* child = entry->child;
+	while (child)
+	{
+		walkEntry* next = child->next;
+		result |= writeWalkEntry(walker, child, fout);
+		freeWalkEntry(walker, child);
+		child = next;
+	}
+	return result;
+}
+
+// path and everything below it, directories are listed and stat'ed by scanner
+// threads that steal each other's subtrees while this thread writes in order
+int tar(char* path, FILE* fout)
+{
+	walkEntry* root = (walkEntry*)mallocAndReset(sizeof(walkEntry), 0);
+	root->fd = -1;
+	root->path = (char*)mallocAndReset(strlen(path) + 1, 0);
+	strcat(root->path, path);
+	if (lstat(path, &root->statBuf))
+	{
+		printf("%s", path);
+		perror(" stat error");
+		freeWalkMemory(root);
+		return 1;
+	}
+	if (S_ISLNK(root->statBuf.st_mode))
+	{
+		root->linkPath = readLinkAt(AT_FDCWD, path, &root->linkError);
+	}
+	if (!S_ISDIR(root->statBuf.st_mode))
+	{
+		int result = tarOneEntry(root, fout);
+		freeWalkMemory(root);
+		return result;
+	}
+
+	treeWalker walker;
+	memset(&walker, 0, sizeof(treeWalker));
+	walker.number = threadNumber > 0 ? threadNumber : WALK_THREADS_PER_CPU * onlineThreadNumber();
+	walker.queue = (walkQueue*)mallocAndReset((walker.number + 1) * sizeof(walkQueue), 0);
+	walker.thread = (pthread_t*)mallocAndReset(walker.number * sizeof(pthread_t), 0);
+	walkWorker* worker = (walkWorker*)mallocAndReset(walker.number * sizeof(walkWorker), 0);
+	pthread_mutex_init(&walker.lock, NULL);
+	pthread_cond_init(&walker.wake, NULL);
+	pthread_cond_init(&walker.done, NULL);
+	walker.pending = 1;
+
+	pthread_mutex_lock(&walker.lock);
+	pushWalkTask(&walker, walker.number, root);
+	pthread_mutex_unlock(&walker.lock);
+	for (int i = 0; i < walker.number; i++)
+	{
+		worker[i].walker = &walker;
+		worker[i].id = i;
+		if (pthread_create(&walker.thread[i], NULL, walkThread, &worker[i]))
+		{
+			perror("pthread_create error");
+			exit(1);
+		}
+	}
+
+	int result = writeWalkEntry(&walker, root, fout);
+	freeWalkEntry(&walker, root);
+
+	pthread_mutex_lock(&walker.lock);
+	walker.stop = 1;
+	pthread_cond_broadcast(&walker.wake);
+	pthread_mutex_unlock(&walker.lock);
+	for (int i = 0; i < walker.number; i++) pthread_join(walker.thread[i], NULL);
+
+	walkEntry* entry;
+	for (int i = 0; i <= walker.number; i++)
+	{
+		while ((entry = takeWalkTask(&walker, i))) freeWalkMemory(entry); // orphans, all archived already
+		free(walker.queue[i].task);
+	}
+	pthread_mutex_destroy(&walker.lock);
+	pthread_cond_destroy(&walker.wake);
+	pthread_cond_destroy(&walker.done);
+	free(walker.queue);
+	free(walker.thread);
+	free(worker);
+	return result;
+}
+
+int freeSpace(char* srcPath, char* linkPath, Record* block)
+{
+	if (srcPath) free(srcPath);
+	if (linkPath) free(linkPath);
+	if (block) free(block);
+	return 0;
+}
+
+int ioRingSetup(ioRing* ring, unsigned entries)
+{
+	struct io_uring_params params;
+	memset(ring, 0, sizeof(ioRing));
+	memset(&params, 0, sizeof(params));
+	ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (ring->fd < 0) return 1;
+
+	ring->sqMapLength = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cqMapLength = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (ring->cqMapLength > ring->sqMapLength) ring->sqMapLength = ring->cqMapLength;
+		ring->cqMapLength = 0;
+	}
+	ring->sqMap = mmap(NULL, ring->sqMapLength, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sqMap == MAP_FAILED)
+	{
+		close(ring->fd);
+		return 1;
+	}
+	ring->cqMap = ring->sqMap;
+	if (ring->cqMapLength)
+	{
+		ring->cqMap = mmap(NULL, ring->cqMapLength, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cqMap == MAP_FAILED)
+		{
+			munmap(ring->sqMap, ring->sqMapLength);
+			close(ring->fd);
+			return 1;
+		}
+	}
+	ring->sqeLength = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqe = mmap(NULL, ring->sqeLength, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqe == MAP_FAILED)
+	{
+		if (ring->cqMapLength) munmap(ring->cqMap, ring->cqMapLength);
+		munmap(ring->sqMap, ring->sqMapLength);
+		close(ring->fd);
+		return 1;
+	}
+
+	ring->sqHead = (unsigned*)(ring->sqMap + params.sq_off.head);
+	ring->sqTail = (unsigned*)(ring->sqMap + params.sq_off.tail);
+	ring->sqMask = *(unsigned*)(ring->sqMap + params.sq_off.ring_mask);
+	ring->sqEntries = params.sq_entries;
+	unsigned* array = (unsigned*)(ring->sqMap + params.sq_off.array);
+	for (unsigned i = 0; i < params.sq_entries; i++) array[i] = i; // sqe i always sits in slot i
+	ring->cqHead = (unsigned*)(ring->cqMap + params.cq_off.head);
+	ring->cqTail = (unsigned*)(ring->cqMap + params.cq_off.tail);
+	ring->cqMask = *(unsigned*)(ring->cqMap + params.cq_off.ring_mask);
+	ring->cqe = (struct io_uring_cqe*)(ring->cqMap + params.cq_off.cqes);
+	return 0;
+}
+
+void ioRingFree(ioRing* ring)
+{
+	munmap(ring->sqe, ring->sqeLength);
+	if (ring->cqMapLength) munmap(ring->cqMap, ring->cqMapLength);
+	munmap(ring->sqMap, ring->sqMapLength);
+	close(ring->fd);
+}
+
+// everything queued handed to the kernel, waiting for at least wait completions
+int ioRingSubmit(ioRing* ring, unsigned wait)
+{
+	while (1)
+	{
+		int n = syscall(__NR_io_uring_enter, ring->fd, ring->toSubmit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		if (n >= 0)
+		{
+			ring->toSubmit -= n;
+			return 0;
+		}
+		if (errno != EINTR && errno != EAGAIN && errno != EBUSY) return 1;
+	}
+}
+
+// a cleared sqe, room for length of them in a row is made first so links stay in one batch
+struct io_uring_sqe* ioRingGet(ioRing* ring, unsigned length)
+{
+	unsigned tail = *ring->sqTail;
+	if (tail + length - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) > ring->sqEntries) ioRingSubmit(ring, 0);
+	struct io_uring_sqe* sqe = &ring->sqe[tail & ring->sqMask];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	__atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+	ring->toSubmit++;
+	return sqe;
+}
+
+u_int32_t hashPath(const char* path)
+{
+	u_int32_t h = 2166136261u;
+	while (*path) h = (h ^ (unsigned char)*path++) * 16777619u;
+	return h % IO_RING_PATH_HASH;
+}
+
+// the whole file again with blocking calls, after any step in the ring failed
+int writeRingFileSync(ringFile* file)
+{
+	remove(file->path);
+	int fd = open(file->path, O_WRONLY | O_CREAT | O_TRUNC, file->mode);
+	if (fd < 0)
+	{
+		perror("open file error");
+		return 1;
+	}
+	int result = writeAll(fd, file->buffer, file->size);
+	close(fd);
+	return result;
+}
+
+void finishRingFile(ringExtractor* extractor, int slot)
+{
+	ringFile* file = &extractor->file[slot];
+	if (file->openResult < 0 || file->writeResult != file->size)
+	{
+		if (writeRingFileSync(file)) extractor->result = 1;
+	}
+	int chowned = ownerChanged(file->uid, file->gid);
+	if (chowned) chown(file->path, file->uid, file->gid);
+	if (modeChanged(file->mode, file->mode, chowned)) chmod(file->path, file->mode);
+	struct utimbuf time;
+	time.actime = file->mTime;
+	time.modtime = file->mTime;
+	utime(file->path, &time);
+
+	free(file->path);
+	file->path = NULL;
+	extractor->pathCount[file->hash]--;
+	extractor->freeSlot[extractor->freeNumber++] = slot;
+}
+
+// completions taken off the ring, waiting until at least one slot is free or, with all set, every slot
+void reapRingFiles(ringExtractor* extractor, int all)
+{
+	ioRing* ring = &extractor->ring;
+	while (all ? extractor->freeNumber < IO_RING_FILES : !extractor->freeNumber)
+	{
+		if (ioRingSubmit(ring, 1))
+		{
+			perror("io_uring_enter error");
+			exit(1);
+		}
+		unsigned head = *ring->cqHead;
+		unsigned tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++)
+		{
+			struct io_uring_cqe* cqe = &ring->cqe[head & ring->cqMask];
+			int slot = cqe->user_data >> 2;
+			ringFile* file = &extractor->file[slot];
+			if ((cqe->user_data & 3) == RING_OPEN) file->openResult = cqe->res;
+			else if ((cqe->user_data & 3) == RING_WRITE) file->writeResult = cqe->res;
+			if (!--file->expect) finishRingFile(extractor, slot);
+		}
+		__atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+	}
+}
+
+// a ring with IO_RING_FILES direct descriptor slots, NULL if the kernel can not open into one
+ringExtractor* createRingExtractor()
+{
+	if (!ioRingEnabled) return NULL;
+	ringExtractor* extractor = (ringExtractor*)mallocAndReset(sizeof(ringExtractor), 0);
+	if (ioRingSetup(&extractor->ring, IO_RING_ENTRIES))
+	{
+		free(extractor);
+		return NULL;
+	}
+	int fds[IO_RING_FILES];
+	for (int i = 0; i < IO_RING_FILES; i++) fds[i] = -1;
+	ioRing* ring = &extractor->ring;
+	int result = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES, fds, IO_RING_FILES);
+
+	if (!result)
+	{
+		struct io_uring_sqe* sqe = ioRingGet(ring, 2);
+		sqe->opcode = IORING_OP_OPENAT;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (unsigned long)".";
+		sqe->open_flags = O_RDONLY | O_DIRECTORY;
+		sqe->file_index = 1;
+		sqe->flags = IOSQE_IO_LINK;
+		sqe = ioRingGet(ring, 1);
+		sqe->opcode = IORING_OP_CLOSE;
+		sqe->file_index = 1;
+		result = ioRingSubmit(ring, 2);
+		unsigned head = *ring->cqHead;
+		for (; head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE); head++)
+		{
+			if (ring->cqe[head & ring->cqMask].res) result = 1; // both return 0 when direct opens work
+		}
+		__atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+	}
+	if (result)
+	{
+		ioRingFree(ring);
+		free(extractor);
+		return NULL;
+	}
+
+	for (int i = 0; i < IO_RING_FILES; i++) extractor->freeSlot[i] = IO_RING_FILES - 1 - i;
+	extractor->freeNumber = IO_RING_FILES;
+	return extractor;
+}
+
+int freeRingExtractor(ringExtractor* extractor)
+{
+	reapRingFiles(extractor, 1);
+	for (int i = 0; i < IO_RING_FILES; i++) free(extractor->file[i].buffer);
+	ioRingFree(&extractor->ring);
+	int result = extractor->result;
+	free(extractor);
+	return result;
+}
+
+int ringPathBusy(ringExtractor* extractor, const char* path)
+{
+	return extractor->pathCount[hashPath(path)] != 0;
+}
+
+// the body of one archive member read from fin and written out through the ring,
+// unlink, create, write and close are linked so the kernel runs them back to back
+int queueRingFile(ringExtractor* extractor, char* path, mode_t mode, u_int64_t uid, u_int64_t gid, u_int64_t mTime, u_int64_t size, FILE* fin)
+{
+	reapRingFiles(extractor, 0);
+	int slot = extractor->freeSlot[--extractor->freeNumber];
+	ringFile* file = &extractor->file[slot];
+	u_int64_t padded = (size + 511) / 512 * 512;
+	if (file->capacity < padded)
+	{
+		free(file->buffer);
+		file->buffer = mallocAligned(padded);
+		file->capacity = padded;
+	}
+	if (padded && fread(file->buffer, 1, padded, fin) != padded)
+	{
+		perror("tar file shunhuai");
+		extractor->freeSlot[extractor->freeNumber++] = slot;
+		return 1;
+	}
+
+	file->path = (char*)mallocAndReset(strlen(path) + 1, 0);
+	strcat(file->path, path);
+	file->size = size;
+	file->mode = mode;
+	file->uid = uid;
+	file->gid = gid;
+	file->mTime = mTime;
+	file->hash = hashPath(path);
+	file->openResult = 0;
+	file->writeResult = 0;
+	file->expect = size ? 4 : 3;
+	extractor->pathCount[file->hash]++;
+
+	ioRing* ring = &extractor->ring;
+	struct io_uring_sqe* sqe = ioRingGet(ring, file->expect);
+	sqe->opcode = IORING_OP_UNLINKAT;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (unsigned long)file->path;
+	sqe->flags = IOSQE_IO_HARDLINK; // a missing file is not a failure
+	sqe->user_data = (u_int64_t)slot << 2 | RING_UNLINK;
+
+	sqe = ioRingGet(ring, 1);
+	sqe->opcode = IORING_OP_OPENAT;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (unsigned long)file->path;
+	sqe->len = file->mode; // created with its final mode, so chmod is usually not needed
+	sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+	sqe->file_index = slot + 1;
+	sqe->flags = IOSQE_IO_LINK;
+	sqe->user_data = (u_int64_t)slot << 2 | RING_OPEN;
+
+	if (size)
+	{
+		sqe = ioRingGet(ring, 1);
+		sqe->opcode = IORING_OP_WRITE;
+		sqe->fd = slot;
+		sqe->addr = (unsigned long)file->buffer;
+		sqe->len = size;
+		sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK; // the slot is closed even if the write fails
+		sqe->user_data = (u_int64_t)slot << 2 | RING_WRITE;
+	}
+
+	sqe = ioRingGet(ring, 1);
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->file_index = slot + 1;
+	sqe->user_data = (u_int64_t)slot << 2 | RING_CLOSE;
+
+	if (ring->toSubmit >= ring->sqEntries / 2 && ioRingSubmit(ring, 0))
+	{
+		perror("io_uring_enter error");
+		exit(1);
+	}
+	return 0;
+}
+
+// n more chunks of file written, the last one sets owner, mode and mtime through the fd and closes it
+void finishExtractChunks(extractFile* file, u_int64_t n)
+{
+	if (__atomic_sub_fetch(&file->chunks, n, __ATOMIC_ACQ_REL)) return;
+	int chowned = ownerChanged(file->uid, file->gid);
+	if (chowned) fchown(file->fd, file->uid, file->gid);
+	if (modeChanged(file->mode, file->mode, chowned)) fchmod(file->fd, file->mode);
+	struct timespec time[2];
+	time[0].tv_sec = file->mTime;
+	time[0].tv_nsec = 0;
+	time[1] = time[0];
+	futimens(file->fd, time);
+	if (close(file->fd)) file->failed = 1;
+	if (file->failed) __atomic_store_n(file->result, 1, __ATOMIC_RELAXED);
+	free(file);
+}
+
+void extractBlockJob(void* argument)
+{
+	extractJob* job = (extractJob*)argument;
+	if (writeAllAt(job->file->fd, job->buffer, job->length, job->offset)) __atomic_store_n(&job->file->failed, 1, __ATOMIC_RELAXED);
+	finishExtractChunks(job->file, 1);
+}
+
+// whatever is at path unlinked so a new entry can take its place, returns the parent fd to create it in
+int replaceEntry(untarState* state, char* path)
+{
+	int dirFd = parentDirFd(&state->cache, path);
+	if (unlinkat(dirFd, baseName(path, dirFd), 0) && errno == EISDIR && !remove(path))
+	{
+		freeDirCache(&state->cache); // an empty directory gave way to this entry, forget what was below it
+		dirFd = parentDirFd(&state->cache, path);
+	}
+	return dirFd;
+}
+
+// the body of one archive member read from fin in chunks that pool threads write with pwrite,
+// created with O_EXCL so an existing entry costs an unlink only when there is one
+int queueExtractFile(untarState* state, char* path, mode_t mode, u_int64_t uid, u_int64_t gid, u_int64_t mTime, u_int64_t size, FILE* fin)
+{
+	int dirFd = parentDirFd(&state->cache, path);
+	int fd = openat(dirFd, baseName(path, dirFd), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, mode);
+	if (fd < 0 && errno == EEXIST)
+	{
+		dirFd = replaceEntry(state, path);
+		fd = openat(dirFd, baseName(path, dirFd), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, mode);
+	}
+	if (fd < 0)
+	{
+		perror("open file error");
+		return 1;
+	}
+	extractFile* file = (extractFile*)mallocAndReset(sizeof(extractFile), 0);
+	file->fd = fd;
+	file->mode = mode;
+	file->uid = uid;
+	file->gid = gid;
+	file->mTime = mTime;
+	file->result = &state->result;
+	file->chunks = (size + IO_BUFFER_SIZE - 1) / IO_BUFFER_SIZE;
+	if (!file->chunks)
+	{
+		file->chunks = 1;
+		finishExtractChunks(file, 1);
+		return 0;
+	}
+
+	u_int64_t chunks = file->chunks;
+	u_int64_t left = (size + 511) / 512 * 512;
+	u_int64_t offset = 0;
+	while (left)
+	{
+		extractJob* job = state->job + state->submitted % state->window;
+		waitTask(state->pool, &job->done);
+		if (!job->buffer) job->buffer = mallocAligned(IO_BUFFER_SIZE);
+		size_t n = left < IO_BUFFER_SIZE ? left : IO_BUFFER_SIZE;
+		if (fread(job->buffer, 1, n, fin) != n)
+		{
+			perror("tar file shunhuai");
+			file->failed = 1;
+			finishExtractChunks(file, chunks);
+			return 1;
+		}
+		job->file = file;
+		job->offset = offset;
+		job->length = size - offset < n ? size - offset : n;
+		submitTask(state->pool, extractBlockJob, job, &job->done);
+		state->submitted++;
+		chunks--;
+		left -= n;
+		offset += job->length;
+	}
+	return 0;
+}
+
+// every file queued so far written and closed
+void drainUntar(untarState* state)
+{
+	if (state->ring) reapRingFiles(state->ring, 1);
+	for (int i = 0; i < state->window; i++) waitTask(state->pool, &state->job[i].done);
+}
+
+void addDirMeta(untarState* state, char* path, mode_t mode, u_int64_t uid, u_int64_t gid, u_int64_t mTime, int created)
+{
+	if (state->dirNumber == state->dirCapacity)
+	{
+		state->dirCapacity = state->dirCapacity ? state->dirCapacity * 2 : 64;
+		state->dir = (dirMeta*)realloc(state->dir, state->dirCapacity * sizeof(dirMeta));
+		if (!state->dir)
+		{
+			perror("realloc error");
+			exit(1);
+		}
+	}
+	dirMeta* dir = state->dir + state->dirNumber++;
+	dir->path = (char*)mallocAndReset(strlen(path) + 1, 0);
+	strcat(dir->path, path);
+	dir->mode = mode;
+	dir->uid = uid;
+	dir->gid = gid;
+	dir->mTime = mTime;
+	dir->created = created;
+}
+
+int untarEntries(FILE* fin, untarState* state)
+{
+	ringExtractor* ring = state->ring;
+	while (1)
+	{
+		Record* tarHead = readOneBlock(fin);
+		char* linkPath = NULL;
+		char* srcPath = NULL;
+
+		if (!tarHead) return 1;
+
+		if (tarHead->name[0] == '\0')
+		{
+			freeSpace(srcPath, linkPath, tarHead);
+			return 0;
+		}
+
+		if (tarHead->type == LINKLONG)
+		{
+			if (strcmp("././@LongLink", tarHead->name))
+			{
+				printf("tarHead linkName error\n");
+				freeSpace(srcPath, linkPath, tarHead);
+				return 1;
+			}
+			u_int64_t linkNameSize = charToNumber(tarHead->size);
+			u_int64_t linkNameBlock = (linkNameSize + 511) / 512;
+			linkPath = (char*)mallocAndReset(512 * linkNameBlock + 1, 0); // the name and its padding in one read
+			if (fread(linkPath, 512, linkNameBlock, fin) != linkNameBlock)
+			{
+				perror("untar-linkName");
+				freeSpace(srcPath, linkPath, tarHead);
+				return 1;
+			}
+			linkPath[linkNameSize] = '\0'; // the padding after the name is not ours
+			free(tarHead);
+			tarHead = readOneBlock(fin);
+			if (!tarHead)
+			{
+				freeSpace(srcPath, linkPath, tarHead);
+				return 1;
+			}
+		}
+
+		if (tarHead->type == LONGNAME)
+		{
+			if (strcmp("././@LongLink", tarHead->name))
+			{
+				printf("tarHead linkName error\n");
+				freeSpace(srcPath, linkPath, tarHead);
+				return 1;
+			}
+			u_int64_t srcNameSize = charToNumber(tarHead->size);
+			u_int64_t srcNameBlock = (srcNameSize + 511) / 512;
+			srcPath = (char*)mallocAndReset(512 * srcNameBlock + 1, 0);
+			if (fread(srcPath, 512, srcNameBlock, fin) != srcNameBlock)
+			{
+				perror("untar-srcName");
+				freeSpace(srcPath, linkPath, tarHead);
+				return 1;
+			}
+			srcPath[srcNameSize] = '\0'; // the padding after the name is not ours
+			free(tarHead);
+			tarHead = readOneBlock(fin);
+			if (!tarHead)
+			{
+				freeSpace(srcPath, linkPath, tarHead);
+				return 1;
+			}
+		}
+
+		if (srcPath)
+		{
+			if (strncmp(tarHead->name, srcPath, 100))
+			{
+				printf("srcName bupipei\n");
+				freeSpace(srcPath, linkPath, tarHead);
+				return 1;
+			}
+		}
+		else
+		{
+			srcPath = (char*)mallocAndReset(101, 0);
+			copyNByte(srcPath, tarHead->name, 100);
+		}
+
+		if (linkPath)
+		{
+			if (strncmp(tarHead->link_name, linkPath, 100))
+			{
+				printf("linkName bupipei\n");
+				freeSpace(srcPath, linkPath, tarHead);
+				return 1;
+			}
+		}
+		else
+		{
+			linkPath = (char*)mallocAndReset(101, 0);
+			copyNByte(linkPath, tarHead->link_name, 100);
+		}
+
+		mode_t fileMode = (((tarHead->mode[3] - '0') * 8 + (tarHead->mode[4] - '0')) * 8 + (tarHead->mode[5] - '0')) * 8 + (tarHead->mode[6] - '0');
+
+		u_int64_t uid = charToNumber(tarHead->uid);
+		u_int64_t gid = charToNumber(tarHead->gid);
+
+		if (tarHead->type == DIRECTORY)
+		{
+			int created = 0;
+			createDir(&state->cache, srcPath, &created);
+			addDirMeta(state, srcPath, fileMode, uid, gid, charToNumber(tarHead->mtime), created);
+			freeSpace(srcPath, linkPath, tarHead);
+			continue;
+		}
+
+		u_int64_t fileSize = charToNumber(tarHead->size);
+		int regular = tarHead->type != SYMLINK && tarHead->type != HARDLINK && tarHead->type != FIFO
+			&& tarHead->type != BLOCK && tarHead->type != CHAR;
+		if (!regular) drainUntar(state); // links and nodes may name files still being written
+		else if (ring && ringPathBusy(ring, srcPath)) reapRingFiles(ring, 1);
+
+		createDir(&state->cache, srcPath, NULL);
+
+		if (ring && regular && fileSize <= IO_RING_FILE_SIZE)
+		{
+			int result = queueRingFile(ring, srcPath, fileMode, uid, gid, charToNumber(tarHead->mtime), fileSize, fin);
+			freeSpace(srcPath, linkPath, tarHead);
+			if (result) return 1;
+			continue;
+		}
+
+		int dirFd = regular ? AT_FDCWD : replaceEntry(state, srcPath);
+		int chowned = ownerChanged(uid, gid);
+
+		if (tarHead->type == SYMLINK)
+		{
+			if (symlinkat(linkPath, dirFd, baseName(srcPath, dirFd)))
+			{
+				perror("symLink error");
+				freeSpace(srcPath, linkPath, tarHead);
+				return 1;
+			}
+			if (chowned) fchownat(dirFd, baseName(srcPath, dirFd), uid, gid, AT_SYMLINK_NOFOLLOW); // a link has no mode of its own
+			freeSpace(srcPath, linkPath, tarHead);
+			continue;
+		}
+
+		if (tarHead->type == HARDLINK)
+		{
+			if (linkat(AT_FDCWD, linkPath, dirFd, baseName(srcPath, dirFd), 0))
+			{
+				perror("hardLink error");
+				freeSpace(srcPath, linkPath, tarHead);
+				return 1;
+			}
+			// the inode and its metadata are the target's, already restored
+			freeSpace(srcPath, linkPath, tarHead);
+			continue;
+		}
+
+		if (tarHead->type == FIFO)
+		{
+			if (mkfifoat(dirFd, baseName(srcPath, dirFd), fileMode))
+			{
+				perror("mkfifo error");
+				freeSpace(srcPath, linkPath, tarHead);
+				return 1;
+			}
+			if (chowned) fchownat(dirFd, baseName(srcPath, dirFd), uid, gid, 0);
+			if (modeChanged(fileMode, fileMode, chowned)) fchmodat(dirFd, baseName(srcPath, dirFd), fileMode, 0);
+			freeSpace(srcPath, linkPath, tarHead);
+			continue;
+		}
+
+		if (tarHead->type == BLOCK || tarHead->type == CHAR)
+		{
+			int major = charToNumber(tarHead->major);
+			int minor = charToNumber(tarHead->minor);
+			mode_t deviceMode;
+			if (tarHead->type == BLOCK) deviceMode = S_IFBLK;
+			else deviceMode = S_IFCHR;
+			if (mknodat(dirFd, baseName(srcPath, dirFd), deviceMode | fileMode, MKDEV(major, minor)))
+			{
+				perror("mknod error");
+				freeSpace(srcPath, linkPath, tarHead);
+				continue;
+			}
+			if (chowned) fchownat(dirFd, baseName(srcPath, dirFd), uid, gid, 0);
+			if (modeChanged(fileMode, fileMode, chowned)) fchmodat(dirFd, baseName(srcPath, dirFd), fileMode, 0);
+			freeSpace(srcPath, linkPath, tarHead);
+			continue;
+		}
+
+		if (queueExtractFile(state, srcPath, fileMode, uid, gid, charToNumber(tarHead->mtime), fileSize, fin))
+		{
+			freeSpace(srcPath, linkPath, tarHead);
+			return 1;
+		}
+
+		freeSpace(srcPath, linkPath, tarHead);
+	}
+	return 0;
+}
+
+// the archive in fin restored, small files are created and written through io_uring when the kernel allows
+// and the rest on the thread pool, directory modes and mtimes are set last so no write inside undoes them
+int untar(FILE* fin)
+{
+	untarState state;
+	memset(&state, 0, sizeof(untarState));
+	readProcessIdentity();
+	state.ring = createRingExtractor();
+	int number = onlineThreadNumber();
+	state.window = number * 2;
+	state.pool = createThreadPool(number);
+	state.job = (extractJob*)mallocAndReset(state.window * sizeof(extractJob), 0);
+	for (int i = 0; i < state.window; i++) state.job[i].done = 1;
+
+	int result = untarEntries(fin, &state);
+
+	drainUntar(&state);
+	if (state.ring && freeRingExtractor(state.ring)) result = 1;
+	freeThreadPool(state.pool);
+	for (int i = 0; i < state.window; i++) free(state.job[i].buffer);
+	free(state.job);
+	freeDirCache(&state.cache);
+
+	for (u_int64_t i = 0; i < state.dirNumber; i++)
+	{
+		dirMeta* dir = state.dir + i;
+		int chowned = !dir->created || ownerChanged(dir->uid, dir->gid);
+		if (chowned) chown(dir->path, dir->uid, dir->gid);
+		if (!dir->created || modeChanged(0777, dir->mode, chowned)) chmod(dir->path, dir->mode);
+		struct utimbuf time;
+		time.actime = dir->mTime;
+		time.modtime = dir->mTime;
+		utime(dir->path, &time);
+		free(dir->path);
+	}
+	free(state.dir);
+	return result || state.result;
+}
+
+// code lengths from the frequencies, the sorted leaves and the internal nodes (made in ascending order) are two queues
+int huffman(huffmanContext* context)
+{
+	huffmanItem* table = context->table;
+	u_int64_t leaf[256];
+	int n = 0;
+	for (int i = 0; i < 256; i++)
+	{
+		table[i].length = 0;
+		if (context->frequency[i]) leaf[n++] = context->frequency[i] << 8 | i;
+	}
+	if (n == 1) table[leaf[0] & 0xff].length = 1; // one symbol still needs a bit to be coded
+	if (n < 2) return 0;
+	qsort(leaf, n, sizeof(u_int64_t), compareLeaf);
+
+	u_int64_t weight[256]; // internal node k is node n + k
+	int parent[511];
+	for (int k = 0, i = 0, j = 0; k < n - 1; k++)
+	{
+		weight[k] = 0;
+		for (int child = 0; child < 2; child++)
+		{
+			if (i < n && (j == k || leaf[i] >> 8 <= weight[j]))
+			{
+				weight[k] += leaf[i] >> 8;
+				parent[i++] = n + k;
+			}
+			else
+			{
+				weight[k] += weight[j];
+				parent[n + j++] = n + k;
+			}
+		}
+	}
+
+	unsigned char depth[511]; // parents come after their children, the root is last
+	int maxLength = 0;
+	depth[2 * n - 2] = 0;
+	for (int i = 2 * n - 3; i >= 0; i--)
+	{
+		depth[i] = depth[parent[i]] + 1;
+		if (i < n && depth[i] > maxLength) maxLength = depth[i];
+	}
+	if (maxLength > HUFFMAN_MAX_LENGTH) return limitHuffmanLength(context, leaf, n);
+	for (int i = 0; i < n; i++) table[leaf[i] & 0xff].length = depth[i];
+	return 0;
+}
+
+int buildHuffmanTable(huffmanContext* context)
+{
+	huffman(context);
+	canonicalHuffmanCode(context);
+	return 0;
+}
+
+void flushBits(bitWriter* writer)
+{
+	u_int64_t word = BIG_ENDIAN_64(writer->bitBuffer);
+	memcpy(writer->buffer + writer->length, &word, 8);
+	writer->length += writer->bitCount >> 3;
+	writer->bitBuffer <<= writer->bitCount & ~7;
+	writer->bitCount &= 7;
+}
+
+void putBits(bitWriter* writer, u_int32_t code, int length)
+{
+	if (writer->bitCount + length > 56) flushBits(writer);
+	writer->bitBuffer |= (u_int64_t)code << (64 - writer->bitCount - length);
+	writer->bitCount += length;
+}
+
+// write out whatever is pending, the last byte padded with zero bits, returns the bytes written
+size_t closeBits(bitWriter* writer)
+{
+	flushBits(writer);
+	if (writer->bitCount) writer->buffer[writer->length++] = writer->bitBuffer >> 56;
+	writer->bitBuffer = 0;
+	writer->bitCount = 0;
+	return writer->length;
+}
+
+int putVarint(unsigned char* out, u_int64_t number)
+{
+	int n = 0;
+	while (number >= 0x80)
+	{
+		out[n++] = (number & 0x7f) | 0x80;
+		number >>= 7;
+	}
+	out[n++] = number;
+	return n;
+}
+
+int writeVarint(u_int64_t number, FILE* fout)
+{
+	unsigned char out[10];
+	return fwrite(out, 1, putVarint(out, number), fout) ? 0 : 1;
+}
+
+// returns the bytes taken, 0 if the varint runs past length
+int getVarint(const unsigned char* in, size_t length, u_int64_t* number)
+{
+	*number = 0;
+	for (int n = 0; n < length && n < 10; n++)
+	{
+		*number |= (u_int64_t)(in[n] & 0x7f) << (7 * n);
+		if (!(in[n] & 0x80)) return n + 1;
+	}
+	return 0;
+}
+
+int readVarint(u_int64_t* number, FILE* fin)
+{
+	*number = 0;
+	for (int shift = 0; shift < 64; shift += 7)
+	{
+		int ch = fgetc(fin);
+		if (ch == EOF) return 1;
+		*number |= (u_int64_t)(ch & 0x7f) << shift;
+		if (!(ch & 0x80)) return 0;
+	}
+	return 1;
+}
+
+// code lengths as runs, one byte each: length in the high nibble, run - 1 in the low nibble
+int packCodeLength(huffmanContext* context, unsigned char* packed)
+{
+	huffmanItem* table = context->table;
+	int n = 0;
+	for (int i = 0; i < 256;)
+	{
+		int run = 1;
+		while (i + run < 256 && run < 16 && table[i + run].length == table[i].length) run++;
+		packed[n++] = (table[i].length << 4) | (run - 1);
+		i += run;
+	}
+	return n;
+}
+
+// returns the bytes taken by the packed lengths, -1 if they are truncated or not a complete code
+int unpackCodeLength(huffmanContext* context, const unsigned char* packed, size_t length)
+{
+	huffmanItem* table = context->table;
+	int n = 0;
+	for (int i = 0; i < 256;)
+	{
+		if (n == length) return -1;
+		int run = (packed[n] & 0xf) + 1;
+		if (i + run > 256) return -1;
+		for (int j = 0; j < run; j++) table[i++].length = packed[n] >> 4;
+		n++;
+	}
+
+	u_int32_t kraft = 0; // a usable code fills the code space exactly
+	for (int i = 0; i < 256; i++)
+	{
+		if (table[i].length) kraft += 1u << (HUFFMAN_MAX_LENGTH - table[i].length);
+	}
+	return kraft == 1u << HUFFMAN_MAX_LENGTH ? n : -1;
+}
+
+// adds the byte counts of in[0, length) to frequency, length at most HISTOGRAM_SEGMENT
+HISTOGRAM_CLONES void countSegment(const unsigned char* in, size_t length, u_int64_t* frequency)
+{
+	u_int32_t count[HISTOGRAM_WAYS][256];
+	memset(count, 0, sizeof(count));
+	size_t i = 0;
+	for (; i + 16 <= length; i += 16)
+	{
+		u_int64_t a, b;
+		memcpy(&a, in + i, 8);
+		memcpy(&b, in + i + 8, 8);
+		if (a == b && a == (a & 0xff) * 0x0101010101010101ULL) // tar padding, 16 equal bytes in one add
+		{
+			count[0][a & 0xff] += 16;
+			continue;
+		}
+		count[0][a & 0xff]++;
+		count[1][(a >> 8) & 0xff]++;
+		count[2][(a >> 16) & 0xff]++;
+		count[3][(a >> 24) & 0xff]++;
+		count[0][(a >> 32) & 0xff]++;
+		count[1][(a >> 40) & 0xff]++;
+		count[2][(a >> 48) & 0xff]++;
+		count[3][a >> 56]++;
+		count[0][b & 0xff]++;
+		count[1][(b >> 8) & 0xff]++;
+		count[2][(b >> 16) & 0xff]++;
+		count[3][(b >> 24) & 0xff]++;
+		count[0][(b >> 32) & 0xff]++;
+		count[1][(b >> 40) & 0xff]++;
+		count[2][(b >> 48) & 0xff]++;
+		count[3][b >> 56]++;
+	}
+	for (; i < length; i++) count[0][in[i]]++;
+	for (int j = 0; j < 256; j++) frequency[j] += (u_int64_t)count[0][j] + count[1][j] + count[2][j] + count[3][j];
+}
+
+// byte histogram of in, exact when sampleShift is 0, otherwise only SAMPLE_CHUNK bytes out of every
+// SAMPLE_CHUNK << sampleShift are read and scaled up, good enough to estimate but not to build codes from
+void countBytes(const unsigned char* in, size_t length, u_int64_t* frequency, int sampleShift)
+{
+	memset(frequency, 0, 256 * sizeof(u_int64_t));
+	size_t step = sampleShift ? (size_t)SAMPLE_CHUNK << sampleShift : HISTOGRAM_SEGMENT;
+	size_t take = sampleShift ? SAMPLE_CHUNK : HISTOGRAM_SEGMENT;
+	for (size_t i = 0; i < length; i += step) countSegment(in + i, length - i < take ? length - i : take, frequency);
+	if (sampleShift)
+	{
+		for (int j = 0; j < 256; j++) frequency[j] <<= sampleShift;
+	}
+}
+
+// type and sizes, then the payload moved up to follow them, payload may be out + BLOCK_HEADER_ROOM,
+// returns the bytes of the whole block
+size_t putBlockHeader(unsigned char* out, int type, size_t length, const unsigned char* payload, size_t payloadLength)
+{
+	size_t n = 0;
+	out[n++] = type;
+	n += putVarint(out + n, length);
+	n += putVarint(out + n, payloadLength);
+	memmove(out + n, payload, payloadLength);
+	return n + payloadLength;
+}
+
+size_t storeBlock(const unsigned char* in, size_t length, unsigned char* out, u_int64_t* bitLength)
+{
+	*bitLength = length * 8;
+	return putBlockHeader(out, HF_STORED, length, in, length);
+}
+
+// log2(n) in 1/256 bits
+u_int32_t log2Fixed(u_int32_t n)
+{
+	int high = 31 - __builtin_clz(n);
+	u_int64_t m = ((u_int64_t)n << 16) >> high; // 1.16 fixed point in [1, 2)
+	u_int32_t result = high << 8;
+	for (int i = 7; i >= 0; i--)
+	{
+		m = (m * m) >> 16;
+		if (m >= 2u << 16)
+		{
+			m >>= 1;
+			result |= 1u << i;
+		}
+	}
+	return result;
+}
+
+// frequencies scaled to sum to 1 << tableLog with every present symbol kept at 1 or more
+void normalizeCount(const u_int64_t* frequency, u_int64_t total, int tableLog, u_int32_t* norm)
+{
+	u_int32_t size = 1u << tableLog;
+	u_int32_t sum = 0;
+	for (int i = 0; i < 256; i++)
+	{
+		norm[i] = 0;
+		if (!frequency[i]) continue;
+		norm[i] = (frequency[i] * size + total / 2) / total;
+		if (!norm[i]) norm[i] = 1;
+		sum += norm[i];
+	}
+	while (sum != size) // rounding leaves it off by at most one per symbol, the largest count absorbs it
+	{
+		int largest = 0;
+		for (int i = 1; i < 256; i++)
+		{
+			if (norm[i] > norm[largest]) largest = i;
+		}
+		if (sum > size)
+		{
+			norm[largest]--;
+			sum--;
+		}
+		else
+		{
+			norm[largest]++;
+			sum++;
+		}
+	}
+}
+
+// table log, then each count as a varint, a 0 is followed by how many more zeros come after it
+int packNormCount(const u_int32_t* norm, int tableLog, unsigned char* packed)
+{
+	int n = 0;
+	packed[n++] = tableLog;
+	for (int i = 0; i < 256; i++)
+	{
+		n += putVarint(packed + n, norm[i]);
+		if (norm[i]) continue;
+		int run = 0;
+		while (i + 1 < 256 && !norm[i + 1])
+		{
+			run++;
+			i++;
+		}
+		packed[n++] = run;
+	}
+	return n;
+}
+
+// symbols in state order, spread so that each symbol's states are far apart
+void spreadSymbols(const u_int32_t* norm, int tableLog, unsigned char* symbol)
+{
+	u_int32_t mask = (1u << tableLog) - 1;
+	u_int32_t step = (mask >> 1) + (mask >> 3) + 3;
+	u_int32_t position = 0;
+	for (int i = 0; i < 256; i++)
+	{
+		for (u_int32_t j = 0; j < norm[i]; j++)
+		{
+			symbol[position] = i;
+			position = (position + step) & mask;
+		}
+	}
+}
+
+// an HF_FSE block for in if its payload comes out under limit bytes, else 0; symbols are coded last
+// to first and the bits written forward, so the decoder reads them from the end
+size_t encodeFse(huffmanContext* context, const unsigned char* in, size_t length, unsigned char* out, u_int64_t limit, u_int64_t* bitLength)
+{
+	if (length < FSE_MIN) return 0;
+	int tableLog = 0;
+	u_int32_t norm[256];
+	unsigned char packed[256 * 3 + 1];
+	int packedLength = 0;
+	u_int64_t estimate = limit;
+	for (int log = FSE_MIN_LOG; log <= FSE_MAX_LOG; log++)
+	{
+		u_int32_t candidate[256];
+		normalizeCount(context->frequency, length, log, candidate);
+		u_int64_t cost = 0; // in 1/256 bits
+		for (int i = 0; i < 256; i++)
+		{
+			if (candidate[i]) cost += context->frequency[i] * ((log << 8) - log2Fixed(candidate[i]));
+		}
+		unsigned char candidatePacked[sizeof(packed)];
+		int candidateLength = packNormCount(candidate, log, candidatePacked);
+		if (candidateLength + (cost >> 11) + FSE_STATES * 2 >= estimate) continue;
+		estimate = candidateLength + (cost >> 11) + FSE_STATES * 2;
+		tableLog = log;
+		memcpy(norm, candidate, sizeof(norm));
+		memcpy(packed, candidatePacked, candidateLength);
+		packedLength = candidateLength;
+	}
+	if (!tableLog) return 0;
+	u_int32_t size = 1u << tableLog;
+
+	unsigned char symbol[1 << FSE_MAX_LOG];
+	u_int16_t state[1 << FSE_MAX_LOG]; // per symbol, its states in order
+	u_int32_t start[256];
+	u_int32_t delta[256]; // (maxBits << 16) - (norm << maxBits), bits to write are (state + delta) >> 16
+	spreadSymbols(norm, tableLog, symbol);
+	u_int32_t cumulative = 0;
+	for (int i = 0; i < 256; i++)
+	{
+		start[i] = cumulative;
+		cumulative += norm[i];
+		if (!norm[i]) continue;
+		int maxBits = norm[i] == 1 ? tableLog : tableLog - (31 - __builtin_clz(norm[i] - 1));
+		delta[i] = (maxBits << 16) - (norm[i] << maxBits);
+	}
+	u_int32_t next[256];
+	memcpy(next, start, sizeof(next));
+	for (u_int32_t u = 0; u < size; u++) state[next[symbol[u]]++] = size + u;
+
+	unsigned char* p = out + BLOCK_HEADER_ROOM;
+	memcpy(p, packed, packedLength);
+	size_t n = packedLength;
+	u_int64_t bitBuffer = 0;
+	int bitCount = 0;
+	u_int32_t x[FSE_STATES];
+	for (int s = 0; s < FSE_STATES; s++) x[s] = size;
+	for (size_t i = length; i-- > 0;)
+	{
+		int c = in[i];
+		u_int32_t* y = x + i % FSE_STATES;
+		int bits = (*y + delta[c]) >> 16;
+		bitBuffer |= (u_int64_t)(*y & ((1u << bits) - 1)) << bitCount;
+		bitCount += bits;
+		*y = state[start[c] + (*y >> bits) - norm[c]];
+		if (bitCount >= 32)
+		{
+			if (n + 8 > limit) return 0; // came out worse than estimated
+			u_int64_t word = LITTLE_ENDIAN_64(bitBuffer);
+			memcpy(p + n, &word, 8);
+			n += bitCount >> 3;
+			bitBuffer >>= bitCount & ~7;
+			bitCount &= 7;
+		}
+	}
+	for (int s = FSE_STATES - 1; s >= 0; s--) // the decoder starts from these, state 0 first
+	{
+		bitBuffer |= (u_int64_t)(x[s] - size) << bitCount;
+		bitCount += tableLog;
+	}
+	bitBuffer |= 1ull << bitCount++; // marks where the stream ends
+	if (n + 8 > limit) return 0;
+	u_int64_t word = LITTLE_ENDIAN_64(bitBuffer);
+	memcpy(p + n, &word, 8);
+	n += (bitCount + 7) >> 3;
+	*bitLength = n * 8;
+	return putBlockHeader(out, HF_FSE, length, p, n);
+}
+
+// one block of input to its type, sizes and payload with order-0 coding only, returns the bytes written to out
+size_t encodeEntropy(const unsigned char* in, size_t length, unsigned char* out, u_int64_t* bitLength)
+{
+	huffmanContext context;
+	memset(&context, 0, sizeof(context));
+	countBytes(in, length, context.frequency, 0);
+
+	int symbolNumber = 0;
+	int symbol = 0;
+	for (int i = 0; i < 256; i++)
+	{
+		if (context.frequency[i])
+		{
+			symbolNumber++;
+			symbol = i;
+		}
+	}
+
+	unsigned char type = HF_HUFFMAN;
+	unsigned char packed[256];
+	int packedLength = 0;
+	u_int64_t payloadLength = 1;
+	*bitLength = 8;
+	if (symbolNumber == 1) type = HF_SINGLE;
+	else
+	{
+		buildHuffmanTable(&context);
+		u_int64_t bits = 0;
+		for (int i = 0; i < 256; i++) bits += context.frequency[i] * context.table[i].length;
+		packedLength = packCodeLength(&context, packed);
+		payloadLength = packedLength + (bits + 7) / 8;
+		*bitLength = packedLength * 8 + bits;
+		if (payloadLength >= length) return storeBlock(in, length, out, bitLength);
+	}
+
+	// HUFFMAN_STREAMS bitstreams over consecutive parts of in, the byte sizes of all but the last go first
+	size_t part = (length + HUFFMAN_STREAMS - 1) / HUFFMAN_STREAMS;
+	unsigned char sizes[HUFFMAN_STREAMS * 10];
+	int sizesLength = 0;
+	if (type == HF_HUFFMAN && length >= HUFFMAN4_MIN)
+	{
+		type = HF_HUFFMAN4;
+		payloadLength = packedLength;
+		for (int s = 0; s < HUFFMAN_STREAMS; s++)
+		{
+			u_int64_t bits = 0;
+			size_t end = s < HUFFMAN_STREAMS - 1 ? (s + 1) * part : length;
+			for (size_t i = s * part; i < end; i++) bits += context.table[in[i]].length;
+			if (s < HUFFMAN_STREAMS - 1) sizesLength += putVarint(sizes + sizesLength, (bits + 7) / 8);
+			payloadLength += (bits + 7) / 8;
+		}
+		payloadLength += sizesLength;
+		if (payloadLength >= length) return storeBlock(in, length, out, bitLength);
+	}
+	if (type != HF_SINGLE) // against whichever Huffman layout the block would get
+	{
+		size_t n = encodeFse(&context, in, length, out, payloadLength, bitLength);
+		if (n) return n;
+	}
+
+	size_t n = 0;
+	out[n++] = type;
+	n += putVarint(out + n, length);
+	n += putVarint(out + n, payloadLength);
+
+	if (type == HF_SINGLE) out[n++] = symbol;
+	else
+	{
+		memcpy(out + n, packed, packedLength);
+		n += packedLength;
+		memcpy(out + n, sizes, sizesLength);
+		n += sizesLength;
+		int streams = type == HF_HUFFMAN4 ? HUFFMAN_STREAMS : 1;
+		for (int s = 0; s < streams; s++)
+		{
+			bitWriter writer;
+			memset(&writer, 0, sizeof(writer));
+			writer.buffer = out + n;
+			size_t end = s < streams - 1 ? (s + 1) * part : length;
+			for (size_t i = streams > 1 ? s * part : 0; i < end; i++) putBits(&writer, context.table[in[i]].huffmanCode, context.table[in[i]].length);
+			n += closeBits(&writer);
+		}
+	}
+	return n;
+}
+
+matchFinder* createMatchFinder(size_t size)
+{
+	matchFinder* finder = (matchFinder*)mallocAndReset(sizeof(matchFinder), 0);
+	finder->head = (u_int32_t*)mallocAndReset(sizeof(u_int32_t) << LZ_HASH_BITS, 0);
+	finder->chain = (u_int32_t*)mallocAndReset(size * sizeof(u_int32_t), 0);
+	finder->stream[0] = (unsigned char*)mallocAndReset(size + 16, 0); // every byte a literal
+	finder->stream[1] = (unsigned char*)mallocAndReset(size / LZ_MIN_MATCH + 16, 0); // a token per match
+	finder->stream[2] = (unsigned char*)mallocAndReset(size / 4 + 16, 0); // extras only follow runs of 15 or more
+	finder->stream[3] = (unsigned char*)mallocAndReset(size + 16, 0); // at most 4 varint bytes per match
+	finder->out = (unsigned char*)mallocAndReset(size * 5 / 2 + LZ_STREAMS * BLOCK_SLACK, 0);
+	return finder;
+}
+
+void freeMatchFinder(matchFinder* finder)
+{
+	if (!finder) return;
+	free(finder->head);
+	free(finder->chain);
+	for (int i = 0; i < LZ_STREAMS; i++) free(finder->stream[i]);
+	free(finder->out);
+	free(finder);
+}
+
+u_int32_t hashMatch(const unsigned char* p)
+{
+	u_int32_t word;
+	memcpy(&word, p, 4);
+	return (word * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+size_t matchLength(const unsigned char* a, const unsigned char* b, size_t limit)
+{
+	size_t n = 0;
+	while (n + 8 <= limit)
+	{
+		u_int64_t x, y;
+		memcpy(&x, a + n, 8);
+		memcpy(&y, b + n, 8);
+		if (x != y) return n + (__builtin_ctzll(LITTLE_ENDIAN_64(x ^ y)) >> 3);
+		n += 8;
+	}
+	while (n < limit && a[n] == b[n]) n++;
+	return n;
+}
+
+// longest earlier match for in + i within lzWindow, then i joins its hash chain
+size_t findMatch(matchFinder* finder, const unsigned char* in, size_t i, size_t length, u_int32_t* distance)
+{
+	u_int32_t h = hashMatch(in + i);
+	size_t best = 0;
+	size_t limit = length - i;
+	int nice = lzNiceLength[compressLevel];
+	u_int32_t candidate = finder->head[h];
+	for (int n = lzChainLength[compressLevel]; candidate && n; n--, candidate = finder->chain[candidate - 1])
+	{
+		size_t p = candidate - 1;
+		if (i - p > lzWindow) break;
+		if (in[p + best] != in[i + best]) continue; // cannot beat best
+		size_t m = matchLength(in + p, in + i, limit);
+		if (m > best)
+		{
+			best = m;
+			*distance = i - p;
+			if (best >= nice || best == limit) break;
+		}
+	}
+	finder->chain[i] = finder->head[h];
+	finder->head[h] = i + 1;
+	return best >= LZ_MIN_MATCH ? best : 0;
+}
+
+void addMatchPosition(matchFinder* finder, const unsigned char* in, size_t i)
+{
+	u_int32_t h = hashMatch(in + i);
+	finder->chain[i] = finder->head[h];
+	finder->head[h] = i + 1;
+}
+
+// one sequence: a literal run from in + start, then a match unless matchLength is 0 (the end of the block)
+void putSequence(matchFinder* finder, const unsigned char* in, size_t start, size_t run, size_t match, u_int32_t distance)
+{
+	size_t* n = finder->streamLength;
+	memcpy(finder->stream[0] + n[0], in + start, run);
+	n[0] += run;
+	size_t code = match ? match - LZ_MIN_MATCH : 0;
+	finder->stream[1][n[1]++] = (run < 15 ? run : 15) << 4 | (code < 15 ? code : 15);
+	if (run >= 15) n[2] += putVarint(finder->stream[2] + n[2], run - 15);
+	if (!match) return;
+	if (code >= 15) n[2] += putVarint(finder->stream[2] + n[2], code - 15);
+	n[3] += putVarint(finder->stream[3] + n[3], distance - 1);
+}
+
+// the block split into literals and matches, each of the LZ_STREAMS coded as a nested order-0 block,
+// returns the bytes written to finder->out or 0 if that is not below limit
+size_t encodeLz77(matchFinder* finder, const unsigned char* in, size_t length, size_t limit, u_int64_t* bitLength)
+{
+	memset(finder->head, 0, sizeof(u_int32_t) << LZ_HASH_BITS);
+	memset(finder->streamLength, 0, sizeof(finder->streamLength));
+	size_t start = 0; // first literal not yet in a sequence
+	size_t i = 0;
+	while (i + LZ_MIN_MATCH <= length)
+	{
+		u_int32_t distance = 0;
+		size_t match = findMatch(finder, in, i, length, &distance);
+		if (match && lzLazy[compressLevel] && i + 1 + LZ_MIN_MATCH <= length)
+		{
+			u_int32_t nextDistance = 0;
+			size_t next = findMatch(finder, in, i + 1, length, &nextDistance);
+			if (next > match) // the match from the next byte wins, this one becomes a literal
+			{
+				i++;
+				match = next;
+				distance = nextDistance;
+			}
+		}
+		if (!match)
+		{
+			i++;
+			continue;
+		}
+		putSequence(finder, in, start, i - start, match, distance);
+		size_t end = i + match;
+		for (i++; i < end && i + LZ_MIN_MATCH <= length; i++)
+		{
+			if (finder->head[hashMatch(in + i)] != i + 1) addMatchPosition(finder, in, i);
+		}
+		i = end;
+		start = end;
+	}
+	if (start < length) putSequence(finder, in, start, length - start, 0, 0);
+
+	unsigned char* out = finder->out;
+	size_t n = BLOCK_HEADER_ROOM;
+	for (int s = 0; s < LZ_STREAMS; s++)
+	{
+		u_int64_t bits;
+		n += encodeEntropy(finder->stream[s], finder->streamLength[s], out + n, &bits);
+		if (n - BLOCK_HEADER_ROOM >= limit) return 0;
+	}
+	size_t payloadLength = n - BLOCK_HEADER_ROOM;
+	*bitLength = payloadLength * 8;
+	return putBlockHeader(out, HF_LZ77, length, out + BLOCK_HEADER_ROOM, payloadLength);
+}
+
+// whether long repeats cover at least 1/REPEAT_SHARE of in, so that a random-looking block made of copies
+// (the same .gz twice) still goes to LZ77; every 16th position is remembered and only one 4 KB window in
+// REPEAT_PROBE looks for matches, repeats that long are hard to miss that way
+int hasRepeats(matchFinder* finder, const unsigned char* in, size_t length)
+{
+	memset(finder->head, 0, sizeof(u_int32_t) << LZ_HASH_BITS);
+	size_t repeated = 0;
+	for (size_t i = 0; i + 64 <= length; i++)
+	{
+		int probe = !((i >> 12) % REPEAT_PROBE);
+		if (!probe && (i & 15))
+		{
+			i |= 15;
+			continue;
+		}
+		u_int64_t word;
+		memcpy(&word, in + i, 8);
+		u_int32_t h = (word * 0x9e3779b97f4a7c15ULL) >> (64 - LZ_HASH_BITS);
+		u_int32_t candidate = finder->head[h];
+		if (!(i & 15)) finder->head[h] = i + 1;
+		if (!probe || !candidate) continue;
+		size_t m = matchLength(in + candidate - 1, in + i, length - i);
+		if (m < 64) continue;
+		repeated += m;
+		if (repeated * REPEAT_SHARE >= length) return 1;
+		i += m - 1;
+	}
+	return 0;
+}
+
+// whether every STORE_SEGMENT of in has a sampled order-0 Huffman size above storeThreshold percent of its raw
+// size, one segment of text next to a .gz is enough to keep the block coded
+int looksRandom(const unsigned char* in, size_t length)
+{
+	huffmanContext context;
+	for (size_t i = 0; i < length; i += STORE_SEGMENT)
+	{
+		size_t n = length - i < STORE_SEGMENT ? length - i : STORE_SEGMENT;
+		if (i && n < STORE_SEGMENT / 4) break; // too short a tail to say anything
+		countBytes(in + i, n, context.frequency, n == STORE_SEGMENT ? STORE_SAMPLE_SHIFT : 0);
+		huffman(&context);
+		u_int64_t bits = 0;
+		u_int64_t total = 0;
+		for (int j = 0; j < 256; j++)
+		{
+			bits += context.frequency[j] * context.table[j].length;
+			total += context.frequency[j];
+		}
+		if (bits * 100 <= total * 8 * storeThreshold) return 0;
+	}
+	return length > 0;
+}
+
+// order-0 Huffman, or an HF_LZ77 block when finder is given and that comes out smaller,
+// a block that already looks random (jpg, gz, ...) is stored without trying either
+size_t encodeBlock(const unsigned char* in, size_t length, unsigned char* out, u_int64_t* bitLength, matchFinder* finder)
+{
+	if (looksRandom(in, length) && !(finder && hasRepeats(finder, in, length))) return storeBlock(in, length, out, bitLength);
+	size_t n = encodeEntropy(in, length, out, bitLength);
+	if (!finder || length < LZ_MIN_MATCH) return n;
+	u_int64_t bits;
+	size_t m = encodeLz77(finder, in, length, n, &bits);
+	if (!m || m >= n) return n;
+	memcpy(out, finder->out, m);
+	*bitLength = bits;
+	return m;
+}
+
+// the header records of the block and everything else coded as separate blocks, each with its own tables,
+// the record numbers of the headers go first as varint gaps
+size_t encodeTarBlock(blockJob* job)
+{
+	const unsigned char* in = job->in;
+	size_t length = job->inLength;
+	size_t headerLength = (size_t)job->headerNumber * 512;
+	unsigned char* header = job->split;
+	unsigned char* other = job->split + headerLength;
+	size_t position = 0;
+	for (u_int32_t i = 0; i < job->headerNumber; i++)
+	{
+		size_t start = (size_t)job->header[i] * 512;
+		memcpy(other, in + position, start - position);
+		other += start - position;
+		memcpy(header + i * 512, in + start, 512);
+		position = start + 512;
+	}
+	memcpy(other, in + position, length - position);
+
+	unsigned char* out = job->splitOut;
+	size_t n = BLOCK_HEADER_ROOM;
+	n += putVarint(out + n, job->headerNumber);
+	for (u_int32_t i = 0; i < job->headerNumber; i++) n += putVarint(out + n, job->header[i] - (i ? job->header[i - 1] + 1 : 0));
+	u_int64_t bits;
+	n += encodeBlock(header, headerLength, out + n, &bits, job->finder);
+	n += encodeBlock(job->split + headerLength, length - headerLength, out + n, &bits, job->finder);
+	size_t payloadLength = n - BLOCK_HEADER_ROOM;
+	if (payloadLength >= length) return storeBlock(in, length, job->out, &job->bitLength);
+	job->bitLength = payloadLength * 8;
+	return putBlockHeader(job->out, HF_TAR, length, out + BLOCK_HEADER_ROOM, payloadLength);
+}
+
+void encodeBlockJob(void* argument)
+{
+	blockJob* job = (blockJob*)argument;
+	if (job->headerNumber) job->outLength = encodeTarBlock(job);
+	else job->outLength = encodeBlock(job->in, job->inLength, job->out, &job->bitLength, job->finder);
+}
+
+int verifyCheckSum(Record* block)
+{
+	int sum = calculateCheckSum(block);
+	for (int i = 0; i < 8; i++) sum += ' ' - (unsigned char)block->check[i];
+	return sum == parseOctal(block->check, 8);
+}
+
+void addMember(tarScanner* scanner, const char* name, size_t nameLength, u_int64_t offset, u_int64_t length)
+{
+	if (scanner->memberLength + nameLength + 30 > scanner->memberCapacity)
+	{
+		scanner->memberCapacity = (scanner->memberLength + nameLength + 30) * 2;
+		scanner->member = (unsigned char*)realloc(scanner->member, scanner->memberCapacity);
+		if (!scanner->member)
+		{
+			perror("realloc error");
+			exit(1);
+		}
+	}
+	unsigned char* p = scanner->member + scanner->memberLength;
+	p += putVarint(p, nameLength);
+	memcpy(p, name, nameLength);
+	p += nameLength;
+	p += putVarint(p, offset);
+	p += putVarint(p, length);
+	scanner->memberLength = p - scanner->member;
+	scanner->memberNumber++;
+}
+
+// follow the tar framing of the stream being compressed and note where every member starts
+// also lists the records of in that are headers or long names in header, *headerNumber of them
+void scanTar(tarScanner* scanner, const unsigned char* in, size_t length, u_int32_t* header, u_int32_t* headerNumber)
+{
+	*headerNumber = 0;
+	for (size_t i = 0; i + 512 <= length && !scanner->stop; i += 512, scanner->position += 512)
+	{
+		Record* block = (Record*)(in + i);
+		if (scanner->skip)
+		{
+			if (scanner->nameData) header[(*headerNumber)++] = i / 512;
+			if (scanner->collect && scanner->longNameLength < scanner->longNameSize)
+			{
+				u_int64_t n = scanner->longNameSize - scanner->longNameLength;
+				if (n > 512) n = 512;
+				memcpy(scanner->longName + scanner->longNameLength, block, n);
+				scanner->longNameLength += n;
+			}
+			scanner->skip--;
+			continue;
+		}
+		scanner->collect = 0;
+		scanner->nameData = 0;
+
+		if (!scanner->pending) scanner->entryStart = scanner->position;
+		if (block->name[0] == '\0' || !verifyCheckSum(block))
+		{
+			scanner->stop = 1;
+			break;
+		}
+		header[(*headerNumber)++] = i / 512;
+
+		u_int64_t size = parseOctal(block->size, 12);
+		scanner->skip = (size + 511) / 512;
+		if (block->type == LONGNAME || block->type == LINKLONG)
+		{
+			scanner->pending = 1;
+			scanner->nameData = 1;
+			if (block->type == LONGNAME)
+			{
+				scanner->collect = 1;
+				scanner->longName = (char*)realloc(scanner->longName, size + 1);
+				if (!scanner->longName)
+				{
+					perror("realloc error");
+					exit(1);
+				}
+				scanner->longNameSize = size;
+				scanner->longNameLength = 0;
+			}
+			continue;
+		}
+
+		const char* name = block->name;
+		size_t nameLength = strnlen(block->name, 100);
+		if (scanner->longName && scanner->longNameLength)
+		{
+			name = scanner->longName;
+			nameLength = strnlen(scanner->longName, scanner->longNameLength);
+		}
+		addMember(scanner, name, nameLength, scanner->entryStart, scanner->position + 512 * (1 + scanner->skip) - scanner->entryStart);
+		scanner->pending = 0;
+		scanner->longNameLength = 0;
+	}
+}
+
+// HF_END, then per block its offset from the previous one, size and payload bits,
+// then the member count, the member index length and the index itself, then the trailer
+int writeBlockIndex(blockIndex* index, u_int64_t count, tarScanner* scanner, u_int64_t position, FILE* fout)
+{
+	fputc(HF_END, fout);
+	u_int64_t indexOffset = position + 1;
+	writeVarint(count, fout);
+	for (u_int64_t i = 0; i < count; i++)
+	{
+		writeVarint(index[i].offset - (i ? index[i - 1].offset : 0), fout);
+		writeVarint(index[i].length, fout);
+		writeVarint(index[i].bitLength, fout);
+	}
+	writeVarint(scanner->memberNumber, fout);
+	writeVarint(scanner->memberLength, fout);
+	if (scanner->memberLength) fwrite(scanner->member, 1, scanner->memberLength, fout); // member stays NULL for non-tar input
+	unsigned char trailer[HF_TRAILER_SIZE];
+	for (int i = 0; i < 8; i++) trailer[i] = indexOffset >> (8 * i);
+	memcpy(trailer + 8, HF_INDEX_MAGIC, 4);
+	fwrite(trailer, 1, HF_TRAILER_SIZE, fout);
+	return 0;
+}
+
+int compress(FILE* fin, FILE* fout)
+{
+	unsigned char header[16];
+	memcpy(header, HF_MAGIC, 2);
+	header[2] = HF_VERSION;
+	u_int64_t position = 3 + putVarint(header + 3, blockSize); // bytes written so far
+	fwrite(header, 1, position, fout);
+
+	u_int64_t indexCapacity = 1024;
+	blockIndex* index = (blockIndex*)mallocAndReset(indexCapacity * sizeof(blockIndex), 0);
+	tarScanner scanner;
+	memset(&scanner, 0, sizeof(scanner));
+
+	int number = onlineThreadNumber();
+	int window = number * 2; // blocks read ahead of the one being written
+	threadPool* pool = createThreadPool(number);
+	blockJob* job = (blockJob*)mallocAndReset(window * sizeof(blockJob), 0);
+	for (int i = 0; i < window; i++)
+	{
+		job[i].in = (unsigned char*)mallocAndReset(blockSize, 0);
+		job[i].out = (unsigned char*)mallocAndReset(blockSize + BLOCK_SLACK, 0);
+		if (compressLevel) job[i].finder = createMatchFinder(blockSize);
+		job[i].header = (u_int32_t*)mallocAndReset((blockSize / 512 + 1) * sizeof(u_int32_t), 0);
+		job[i].split = (unsigned char*)mallocAndReset(blockSize, 0);
+		job[i].splitOut = (unsigned char*)mallocAndReset(blockSize + blockSize / 128 + 4 * BLOCK_SLACK, 0);
+	}
+
+	u_int64_t submitted = 0;
+	u_int64_t written = 0;
+	int end = 0;
+	while (1)
+	{
+		while (!end && submitted - written < window)
+		{
+			blockJob* next = job + submitted % window;
+			next->inLength = fread(next->in, 1, blockSize, fin);
+			if (!next->inLength)
+			{
+				end = 1;
+				break;
+			}
+			scanTar(&scanner, next->in, next->inLength, next->header, &next->headerNumber);
+			submitTask(pool, encodeBlockJob, next, &next->done);
+			submitted++;
+		}
+		if (written == submitted) break;
+
+		blockJob* current = job + written % window;
+		waitTask(pool, &current->done);
+		fwrite(current->out, 1, current->outLength, fout);
+		if (written == indexCapacity)
+		{
+			indexCapacity *= 2;
+			index = (blockIndex*)realloc(index, indexCapacity * sizeof(blockIndex));
+			if (!index)
+			{
+				perror("realloc error");
+				exit(1);
+			}
+		}
+		index[written].offset = position;
+		index[written].length = current->inLength;
+		index[written].bitLength = current->bitLength;
+		position += current->outLength;
+		written++;
+	}
+	writeBlockIndex(index, written, &scanner, position, fout);
+
+	freeThreadPool(pool);
+	for (int i = 0; i < window; i++)
+	{
+		free(job[i].in);
+		free(job[i].out);
+		freeMatchFinder(job[i].finder);
+		free(job[i].header);
+		free(job[i].split);
+		free(job[i].splitOut);
+	}
+	free(job);
+	free(index);
+	free(scanner.member);
+	free(scanner.longName);
+
+	return 0;
+}
+
+u_int32_t allocDecodeEntries(decodeTable* table, u_int32_t n)
+{
+	if (table->size + n > table->capacity)
+	{
+		while (table->size + n > table->capacity) table->capacity = table->capacity ? table->capacity * 2 : 1 << DECODE_TABLE_BITS;
+		table->entry = (decodeEntry*)realloc(table->entry, table->capacity * sizeof(decodeEntry));
+		if (!table->entry)
+		{
+			perror("realloc error");
+			exit(1);
+		}
+	}
+	u_int32_t start = table->size;
+	memset(table->entry + start, 0, n * sizeof(decodeEntry));
+	table->size += n;
+	return start;
+}
+
+void setDecodeEntries(decodeEntry* entry, u_int32_t first, u_int32_t n, int symbol, int length)
+{
+	for (u_int32_t i = first; i < first + n; i++)
+	{
+		entry[i].symbol[0] = symbol;
+		entry[i].count = 1;
+		entry[i].length = length;
+		entry[i].firstLength = length;
+	}
+}
+
+// codes up to DECODE_TABLE_BITS long fill the primary table, longer ones a subtable under their prefix
+void fillDecodeTable(decodeTable* table, huffmanContext* context)
+{
+	int subBits = HUFFMAN_MAX_LENGTH - DECODE_TABLE_BITS;
+	for (int i = 0; i < 256; i++)
+	{
+		int length = context->table[i].length;
+		if (!length) continue;
+		u_int32_t code = context->table[i].huffmanCode;
+		if (length <= DECODE_TABLE_BITS)
+		{
+			int spare = DECODE_TABLE_BITS - length;
+			setDecodeEntries(table->entry, code << spare, 1u << spare, i, length);
+			continue;
+		}
+		u_int32_t prefix = code >> (length - DECODE_TABLE_BITS);
+		if (!table->entry[prefix].link)
+		{
+			u_int32_t link = allocDecodeEntries(table, 1u << subBits);
+			table->entry[prefix].link = link;
+			table->entry[prefix].length = subBits;
+		}
+		int spare = HUFFMAN_MAX_LENGTH - length;
+		u_int32_t low = code & ((1u << (length - DECODE_TABLE_BITS)) - 1);
+		setDecodeEntries(table->entry + table->entry[prefix].link, low << spare, 1u << spare, i, length - DECODE_TABLE_BITS);
+	}
+}
+
+// let each primary entry decode as many whole symbols as its DECODE_TABLE_BITS bits hold
+void combineDecodeSymbols(decodeTable* table)
+{
+	u_int32_t mask = (1u << DECODE_TABLE_BITS) - 1;
+	decodeEntry single[1 << DECODE_TABLE_BITS];
+	memcpy(single, table->entry, sizeof(single));
+	for (u_int32_t i = 0; i <= mask; i++)
+	{
+		decodeEntry* e = table->entry + i;
+		if (!e->count) continue;
+		while (e->count < DECODE_SYMBOLS)
+		{
+			decodeEntry* next = single + ((i << e->length) & mask);
+			if (!next->count || next->firstLength > DECODE_TABLE_BITS - e->length) break;
+			e->symbol[e->count++] = next->symbol[0];
+			e->length += next->firstLength;
+		}
+	}
+}
+
+int buildDecodeTable(decodeTable* table, huffmanContext* context)
+{
+	table->size = 0;
+	allocDecodeEntries(table, 1u << DECODE_TABLE_BITS);
+	fillDecodeTable(table, context);
+	combineDecodeSymbols(table);
+	return 0;
+}
+
+void refillBits(bitReader* reader)
+{
+	if (reader->length - reader->position >= 8)
+	{
+		u_int64_t word;
+		memcpy(&word, reader->buffer + reader->position, 8);
+		reader->bitBuffer |= BIG_ENDIAN_64(word) >> reader->bitCount;
+		reader->position += (63 - reader->bitCount) >> 3;
+		reader->bitCount |= 56;
+		return;
+	}
+	while (reader->bitCount <= 56)
+	{
+		if (reader->position == reader->length)
+		{
+			reader->bitCount = 64; // past the end of the stream, feed zero bits
+			return;
+		}
+		reader->bitBuffer |= (u_int64_t)reader->buffer[reader->position++] << (56 - reader->bitCount);
+		reader->bitCount += 8;
+	}
+}
+
+void consumeBits(bitReader* reader, int n)
+{
+	reader->bitBuffer <<= n;
+	reader->bitCount -= n;
+}
+
+// decode remaining symbols into out, which has DECODE_SYMBOLS bytes of slack at the end
+void decodeHuffman(decodeTable* table, bitReader* reader, unsigned char* out, size_t remaining)
+{
+	while (remaining)
+	{
+		if (reader->bitCount < DECODE_TABLE_BITS) refillBits(reader);
+		int bits = DECODE_TABLE_BITS;
+		decodeEntry* e = table->entry + (reader->bitBuffer >> (64 - bits));
+		while (!e->count)
+		{
+			consumeBits(reader, bits);
+			if (reader->bitCount < DECODE_TABLE_BITS) refillBits(reader);
+			bits = e->length;
+			e = table->entry + e->link + (reader->bitBuffer >> (64 - bits));
+		}
+
+		if (remaining >= DECODE_SYMBOLS) memcpy(out, e->symbol, DECODE_SYMBOLS);
+		else memcpy(out, e->symbol, remaining); // stays inside out, the next stream may be decoded right behind it
+		if (e->count < remaining)
+		{
+			out += e->count;
+			remaining -= e->count;
+			consumeBits(reader, e->length);
+		}
+		else remaining = 0;
+	}
+}
+
+// HUFFMAN_STREAMS independent bitstreams stepped together so their table lookups overlap, each writes its own
+// part of out and the last few symbols of every part go through decodeHuffman() so no part runs into the next
+void decodeHuffman4(decodeTable* table, bitReader* reader, unsigned char** out, size_t* remaining)
+{
+	u_int64_t bitBuffer[HUFFMAN_STREAMS]; // kept out of the readers so the compiler can hold them in registers
+	int bitCount[HUFFMAN_STREAMS];
+	for (int s = 0; s < HUFFMAN_STREAMS; s++)
+	{
+		refillBits(reader + s);
+		bitBuffer[s] = reader[s].bitBuffer;
+		bitCount[s] = reader[s].bitCount;
+	}
+	while (remaining[0] >= DECODE_SYMBOLS && remaining[1] >= DECODE_SYMBOLS && remaining[2] >= DECODE_SYMBOLS && remaining[3] >= DECODE_SYMBOLS)
+	{
+#pragma GCC unroll 4
+		for (int s = 0; s < HUFFMAN_STREAMS; s++)
+		{
+			bitReader* r = reader + s;
+			if (bitCount[s] < HUFFMAN_MAX_LENGTH)
+			{
+				if (r->length - r->position < 8) goto slow; // near the end of this stream
+				u_int64_t word;
+				memcpy(&word, r->buffer + r->position, 8);
+				bitBuffer[s] |= BIG_ENDIAN_64(word) >> bitCount[s];
+				r->position += (63 - bitCount[s]) >> 3;
+				bitCount[s] |= 56;
+			}
+			decodeEntry* e = table->entry + (bitBuffer[s] >> (64 - DECODE_TABLE_BITS));
+			if (!e->count)
+			{
+				bitBuffer[s] <<= DECODE_TABLE_BITS;
+				bitCount[s] -= DECODE_TABLE_BITS;
+				e = table->entry + e->link + (bitBuffer[s] >> (64 - e->length));
+			}
+			memcpy(out[s], e->symbol, DECODE_SYMBOLS);
+			out[s] += e->count;
+			remaining[s] -= e->count;
+			bitBuffer[s] <<= e->length;
+			bitCount[s] -= e->length;
+		}
+	}
+slow:
+	for (int s = 0; s < HUFFMAN_STREAMS; s++)
+	{
+		reader[s].bitBuffer = bitBuffer[s];
+		reader[s].bitCount = bitCount[s];
+		decodeHuffman(table, reader + s, out[s], remaining[s]);
+	}
+}
+
+// the n bits just below *position, reading an HF_FSE stream from its end, 0 once the stream is used up
+u_int32_t readBitsBack(const unsigned char* stream, size_t length, int64_t* position, int n)
+{
+	*position -= n;
+	if (*position < 0) return 0;
+	size_t byte = *position >> 3;
+	u_int64_t word = 0;
+	memcpy(&word, stream + byte, byte + 8 <= length ? 8 : length - byte);
+	return (LITTLE_ENDIAN_64(word) >> (*position & 7)) & ((1u << n) - 1);
+}
+
+int decodeFse(const unsigned char* in, size_t inLength, unsigned char* out, size_t length)
+{
+	if (!inLength || in[0] < 5 || in[0] > FSE_MAX_LOG) return 1;
+	int tableLog = in[0];
+	u_int32_t size = 1u << tableLog;
+	u_int32_t norm[256];
+	u_int64_t sum = 0;
+	size_t n = 1;
+	for (int i = 0; i < 256; i++)
+	{
+		u_int64_t count = 0;
+		int m = getVarint(in + n, inLength - n, &count);
+		if (!m || count > size) return 1;
+		n += m;
+		norm[i] = count;
+		sum += count;
+		if (count) continue;
+		if (n == inLength || in[n] > 255 - i) return 1;
+		for (int run = in[n++]; run; run--) norm[++i] = 0;
+	}
+	if (sum != size) return 1;
+
+	unsigned char symbol[1 << FSE_MAX_LOG];
+	fseEntry table[1 << FSE_MAX_LOG];
+	spreadSymbols(norm, tableLog, symbol);
+	for (u_int32_t u = 0; u < size; u++)
+	{
+		u_int32_t y = norm[symbol[u]]++; // counts up through [norm, 2 * norm)
+		table[u].symbol = symbol[u];
+		table[u].bits = tableLog - (31 - __builtin_clz(y));
+		table[u].next = (y << table[u].bits) - size;
+	}
+
+	const unsigned char* stream = in + n;
+	size_t streamLength = inLength - n;
+	if (!streamLength || !stream[streamLength - 1]) return 1;
+	int64_t position = (streamLength - 1) * 8 + 31 - __builtin_clz(stream[streamLength - 1]); // below the end marker
+	u_int32_t state[FSE_STATES];
+	for (int s = 0; s < FSE_STATES; s++) state[s] = readBitsBack(stream, streamLength, &position, tableLog);
+
+	// one 8 byte load holds at least 56 bits below position, enough for 4 symbols of FSE_MAX_LOG bits
+	size_t i = 0;
+	for (; length - i >= 4 && position >= 56; i += 4)
+	{
+		size_t byte = (position >> 3) - 7;
+		u_int64_t word;
+		memcpy(&word, stream + byte, 8);
+		word = LITTLE_ENDIAN_64(word);
+		int top = position - byte * 8;
+#pragma GCC unroll 4
+		for (int k = 0; k < 4; k++)
+		{
+			fseEntry e = table[state[k % FSE_STATES]];
+			out[i + k] = e.symbol;
+			top -= e.bits;
+			state[k % FSE_STATES] = e.next + ((word >> top) & ((1u << e.bits) - 1));
+		}
+		position = byte * 8 + top;
+	}
+	for (; i < length; i++)
+	{
+		fseEntry e = table[state[i % FSE_STATES]];
+		out[i] = e.symbol;
+		state[i % FSE_STATES] = e.next + readBitsBack(stream, streamLength, &position, e.bits);
+	}
+	for (int s = 0; s < FSE_STATES; s++)
+	{
+		if (state[s]) return 1; // not back at the states the encoder started from
+	}
+	return position != 0;
+}
+
+int decodeBlock(int type, const unsigned char* in, size_t inLength, unsigned char* out, size_t length, decodeTable* table);
+
+// replays the sequences of an HF_LZ77 block, every count and distance checked against what is left
+int replayLz77(unsigned char** stream, size_t* streamLength, unsigned char* out, size_t length)
+{
+	size_t used[LZ_STREAMS] = { 0 };
+	size_t position = 0;
+	while (position < length)
+	{
+		if (used[1] == streamLength[1]) return 1;
+		int token = stream[1][used[1]++];
+		u_int64_t run = token >> 4;
+		u_int64_t extra = 0;
+		int m = 0;
+		if (run == 15)
+		{
+			if (!(m = getVarint(stream[2] + used[2], streamLength[2] - used[2], &extra))) return 1;
+			used[2] += m;
+			run += extra;
+		}
+		if (run > length - position || run > streamLength[0] - used[0]) return 1;
+		memcpy(out + position, stream[0] + used[0], run);
+		used[0] += run;
+		position += run;
+		if (position == length) break;
+
+		u_int64_t match = token & 15;
+		if (match == 15)
+		{
+			if (!(m = getVarint(stream[2] + used[2], streamLength[2] - used[2], &extra))) return 1;
+			used[2] += m;
+			match += extra;
+		}
+		match += LZ_MIN_MATCH;
+		u_int64_t distance = 0;
+		if (!(m = getVarint(stream[3] + used[3], streamLength[3] - used[3], &distance))) return 1;
+		used[3] += m;
+		distance++;
+		if (distance > position || match > length - position) return 1;
+
+		unsigned char* p = out + position;
+		if (distance >= match) memcpy(p, p - distance, match);
+		else for (u_int64_t i = 0; i < match; i++) p[i] = p[i - distance]; // overlapping, repeats the last distance bytes
+		position += match;
+	}
+	for (int s = 0; s < LZ_STREAMS; s++)
+	{
+		if (used[s] != streamLength[s]) return 1;
+	}
+	return 0;
+}
+
+// the nested block at in + *n decoded into a new buffer with DECODE_SYMBOLS bytes of slack, NULL if it is broken,
+// longer than maxLength or of a type that may not nest here
+unsigned char* readNestedBlock(const unsigned char* in, size_t inLength, size_t* n, size_t maxLength, size_t* length, int allowLz77, decodeTable* table)
+{
+	u_int64_t subLength = 0;
+	u_int64_t payloadLength = 0;
+	int type = *n < inLength ? in[(*n)++] : HF_TAR;
+	int m = 0;
+	if (type == HF_TAR || (type == HF_LZ77 && !allowLz77)
+		|| !(m = getVarint(in + *n, inLength - *n, &subLength)) || !(*n += m)
+		|| !(m = getVarint(in + *n, inLength - *n, &payloadLength)) || !(*n += m)
+		|| subLength > maxLength || payloadLength > inLength - *n) return NULL;
+	unsigned char* out = (unsigned char*)mallocAndReset(subLength + DECODE_SYMBOLS, 0);
+	if (decodeBlock(type, in + *n, payloadLength, out, subLength, table))
+	{
+		free(out);
+		return NULL;
+	}
+	*n += payloadLength;
+	*length = subLength;
+	return out;
+}
+
+int decodeLz77(const unsigned char* in, size_t inLength, unsigned char* out, size_t length, decodeTable* table)
+{
+	unsigned char* stream[LZ_STREAMS] = { NULL };
+	size_t streamLength[LZ_STREAMS] = { 0 };
+	int result = 1;
+	size_t n = 0;
+	int s = 0;
+	while (s < LZ_STREAMS && (stream[s] = readNestedBlock(in, inLength, &n, length + BLOCK_SLACK, streamLength + s, 0, table))) s++;
+	if (s == LZ_STREAMS && n == inLength) result = replayLz77(stream, streamLength, out, length);
+	for (int i = 0; i < LZ_STREAMS; i++) free(stream[i]);
+	return result;
+}
+
+// puts the header records of an HF_TAR block back between the other bytes
+int decodeTarBlock(const unsigned char* in, size_t inLength, unsigned char* out, size_t length, decodeTable* table)
+{
+	u_int64_t headerNumber = 0;
+	size_t n = getVarint(in, inLength, &headerNumber);
+	if (!n || headerNumber > length / 512) return 1;
+	u_int32_t* record = (u_int32_t*)mallocAndReset((headerNumber ? headerNumber : 1) * sizeof(u_int32_t), 0);
+	u_int64_t next = 0; // lowest record number the coming header may have
+	int m = 0;
+	u_int64_t i = 0;
+	for (; i < headerNumber; i++)
+	{
+		u_int64_t gap = 0;
+		if (!(m = getVarint(in + n, inLength - n, &gap)) || gap >= length / 512 - next) break;
+		n += m;
+		record[i] = next + gap;
+		next = record[i] + 1;
+	}
+
+	int result = 1;
+	size_t headerLength = 0;
+	size_t otherLength = 0;
+	unsigned char* header = NULL;
+	unsigned char* other = NULL;
+	if (i == headerNumber
+		&& (header = readNestedBlock(in, inLength, &n, headerNumber * 512, &headerLength, 1, table))
+		&& (other = readNestedBlock(in, inLength, &n, length - headerNumber * 512, &otherLength, 1, table))
+		&& n == inLength && headerLength == headerNumber * 512 && otherLength == length - headerLength)
+	{
+		size_t position = 0;
+		unsigned char* p = other;
+		for (i = 0; i < headerNumber; i++)
 		{
-			linkPath = (char*)mallocAndReset(101, 0);
-			copyNByte(linkPath, tarHead->link_name, 100);
+			size_t start = (size_t)record[i] * 512;
+			memcpy(out + position, p, start - position);
+			p += start - position;
+			memcpy(out + start, header + i * 512, 512);
+			position = start + 512;
 		}
+		memcpy(out + position, p, length - position);
+		result = 0;
+	}
+	free(header);
+	free(other);
+	free(record);
+	return result;
+}
 
-		mode_t fileMode = (((tarHead->mode[3] - '0') * 8 + (tarHead->mode[4] - '0')) * 8 + (tarHead->mode[5] - '0')) * 8 + (tarHead->mode[6] - '0');
+int decodeBlock(int type, const unsigned char* in, size_t inLength, unsigned char* out, size_t length, decodeTable* table)
+{
+	if (type == HF_STORED)
+	{
+		if (inLength != length) return 1;
+		memcpy(out, in, length);
+		return 0;
+	}
+	if (type == HF_SINGLE)
+	{
+		if (inLength != 1) return 1;
+		memset(out, in[0], length);
+		return 0;
+	}
+	if (type == HF_LZ77) return decodeLz77(in, inLength, out, length, table);
+	if (type == HF_TAR) return decodeTarBlock(in, inLength, out, length, table);
+	if (type == HF_FSE) return decodeFse(in, inLength, out, length);
+	if (type != HF_HUFFMAN && type != HF_HUFFMAN4) return 1;
+	if (type == HF_HUFFMAN4 && length < HUFFMAN4_MIN) return 1; // its parts would not all be there
 
-		u_int64_t uid = charToNumber(tarHead->uid);
-		u_int64_t gid = charToNumber(tarHead->gid);
+	huffmanContext context;
+	memset(&context, 0, sizeof(context));
+	int packedLength = unpackCodeLength(&context, in, inLength);
+	if (packedLength < 0) return 1;
+	canonicalHuffmanCode(&context);
+	buildDecodeTable(table, &context);
 
-		if (tarHead->type == DIRECTORY)
+	if (type == HF_HUFFMAN)
+	{
+		bitReader reader;
+		memset(&reader, 0, sizeof(reader));
+		reader.buffer = in + packedLength;
+		reader.length = inLength - packedLength;
+		decodeHuffman(table, &reader, out, length);
+		return 0;
+	}
+
+	bitReader reader[HUFFMAN_STREAMS];
+	unsigned char* part[HUFFMAN_STREAMS];
+	size_t remaining[HUFFMAN_STREAMS];
+	memset(reader, 0, sizeof(reader));
+	size_t n = packedLength;
+	u_int64_t size[HUFFMAN_STREAMS];
+	for (int s = 0; s < HUFFMAN_STREAMS - 1; s++)
+	{
+		int m = getVarint(in + n, inLength - n, size + s);
+		if (!m) return 1;
+		n += m;
+	}
+	size_t partLength = (length + HUFFMAN_STREAMS - 1) / HUFFMAN_STREAMS;
+	for (int s = 0; s < HUFFMAN_STREAMS; s++)
+	{
+		if (s < HUFFMAN_STREAMS - 1 && size[s] > inLength - n) return 1;
+		reader[s].buffer = in + n;
+		reader[s].length = s < HUFFMAN_STREAMS - 1 ? size[s] : inLength - n;
+		n += reader[s].length;
+		part[s] = out + s * partLength;
+		remaining[s] = s < HUFFMAN_STREAMS - 1 ? partLength : length - (HUFFMAN_STREAMS - 1) * partLength;
+	}
+	decodeHuffman4(table, reader, part, remaining);
+	return 0;
+}
+
+// block index from the trailer of a seekable stream starting at start, returns 0 if there is one
+int readBlockIndex(FILE* fin, off_t start, blockIndex** index, u_int64_t* count, u_int64_t* end)
+{
+	unsigned char trailer[HF_TRAILER_SIZE];
+	off_t fileEnd;
+	if (fseeko(fin, 0, SEEK_END) || (fileEnd = ftello(fin)) < start + HF_TRAILER_SIZE) return 1;
+	if (fseeko(fin, fileEnd - HF_TRAILER_SIZE, SEEK_SET) || fread(trailer, 1, HF_TRAILER_SIZE, fin) != HF_TRAILER_SIZE) return 1;
+	if (memcmp(trailer + 8, HF_INDEX_MAGIC, 4)) return 1;
+
+	u_int64_t indexOffset = 0;
+	for (int i = 0; i < 8; i++) indexOffset |= (u_int64_t)trailer[i] << (8 * i);
+	if (!indexOffset || indexOffset > fileEnd - start - HF_TRAILER_SIZE || fseeko(fin, start + indexOffset, SEEK_SET)) return 1;
+	if (readVarint(count, fin) || *count > indexOffset) return 1;
+
+	*index = (blockIndex*)mallocAndReset((*count ? *count : 1) * sizeof(blockIndex), 0);
+	u_int64_t offset = 0;
+	for (u_int64_t i = 0; i < *count; i++)
+	{
+		u_int64_t delta;
+		if (readVarint(&delta, fin) || readVarint(&(*index)[i].length, fin) || readVarint(&(*index)[i].bitLength, fin))
 		{
-			if (access(srcPath, F_OK)) createDir(srcPath);
-			chmod(srcPath, fileMode);
-			chown(srcPath, uid, gid);
-			freeSpace(srcPath, linkPath, tarHead);
-			continue;
+			free(*index);
+			*index = NULL;
+			return 1;
 		}
+		offset += delta;
+		(*index)[i].offset = offset;
+	}
+	*end = indexOffset - 1; // the HF_END byte
+	return 0; // fin is left at the member index
+}
+
+// size of the type and sizes in front of a block of inLength bytes holding length, 0 if they do not match
+int blockHeaderLength(const unsigned char* in, size_t inLength, size_t length)
+{
+	u_int64_t blockLength = 0;
+	u_int64_t payloadLength = 0;
+	int n = 1;
+	int m = 0;
+	if (inLength > 1
+		&& (m = getVarint(in + n, inLength - n, &blockLength)) && (n += m)
+		&& (m = getVarint(in + n, inLength - n, &payloadLength)) && (n += m)
+		&& blockLength == length && payloadLength == inLength - n) return n;
+	return 0;
+}
 
-		createDir(srcPath);
-		remove(srcPath);
+// a whole block of inLength bytes, type and sizes included, into out, which has DECODE_SYMBOLS bytes of slack
+int readBlock(const unsigned char* in, size_t inLength, unsigned char* out, size_t length, decodeTable* table)
+{
+	int n = blockHeaderLength(in, inLength, length);
+	return !n || decodeBlock(in[0], in + n, inLength - n, out, length, table);
+}
 
-		if (tarHead->type == SYMLINK)
+void decodeBlockJob(void* argument)
+{
+	decodeJob* job = (decodeJob*)argument;
+	int n = blockHeaderLength(job->in, job->inLength, job->length);
+	if (n && job->in[0] == HF_STORED && job->fout >= 0) // written straight from the mapped archive
+	{
+		if (job->inLength - n != job->length) job->result = 1;
+		else job->result = writeAllAt(job->fout, (const char*)job->in + n, job->length, job->outOffset) ? 2 : 0;
+		return;
+	}
+
+	unsigned char* out = job->fout < 0 ? job->out : (unsigned char*)mallocAndReset(job->length + DECODE_SYMBOLS, 0);
+	decodeTable table;
+	memset(&table, 0, sizeof(table));
+
+	job->result = readBlock(job->in, job->inLength, out, job->length, &table);
+	if (!job->result && job->fout >= 0 && writeAllAt(job->fout, (const char*)out, job->length, job->outOffset)) job->result = 2;
+
+	if (out != job->out) free(out);
+	free(table.entry);
+}
+
+// mapped bytes of indexed block i, 0 if the index does not fit the stream
+size_t indexedBlockLength(blockIndex* index, u_int64_t count, u_int64_t end, u_int64_t i)
+{
+	u_int64_t next = i + 1 < count ? index[i + 1].offset : end;
+	if (next <= index[i].offset || index[i].length > MAX_BLOCK_SIZE || next - index[i].offset > MAX_BLOCK_SIZE + BLOCK_SLACK) return 0;
+	return next - index[i].offset;
+}
+
+// every block of the mapped stream decoded on the thread pool straight to its place in fout
+int uncompressParallel(const unsigned char* stream, FILE* fout, blockIndex* index, u_int64_t count, u_int64_t end)
+{
+	off_t outStart = ftello(fout);
+	if (outStart < 0) outStart = 0;
+	decodeJob* job = (decodeJob*)mallocAndReset((count ? count : 1) * sizeof(decodeJob), 0);
+	u_int64_t outOffset = outStart;
+	for (u_int64_t i = 0; i < count; i++)
+	{
+		if (!(job[i].inLength = indexedBlockLength(index, count, end, i)))
 		{
-			if (symlink(linkPath, srcPath))
-			{
-				perror("symLink error");
-				freeSpace(srcPath, linkPath, tarHead);
-				return 1;
-			}
-			chmod(srcPath, fileMode);
-			chown(srcPath, uid, gid);
-			freeSpace(srcPath, linkPath, tarHead);
-			continue;
+			printf("uncompress: hf block index broken\n");
+			free(job);
+			return 1;
 		}
+		job[i].in = stream + index[i].offset;
+		job[i].fout = fileno(fout);
+		job[i].outOffset = outOffset;
+		job[i].length = index[i].length;
+		outOffset += index[i].length;
+	}
 
-		if (tarHead->type == HARDLINK)
+	fflush(fout);
+	if (ftruncate(fileno(fout), outOffset)) perror("ftruncate");
+
+	threadPool* pool = createThreadPool(onlineThreadNumber());
+	for (u_int64_t i = 0; i < count; i++) submitTask(pool, decodeBlockJob, job + i, &job[i].done);
+	int result = 0;
+	for (u_int64_t i = 0; i < count; i++)
+	{
+		waitTask(pool, &job[i].done);
+		if (job[i].result)
 		{
-			if (link(linkPath, srcPath))
-			{
-				perror("hardLink error");
-				freeSpace(srcPath, linkPath, tarHead);
-				return 1;
-			}
-			chmod(srcPath, fileMode);
-			chown(srcPath, uid, gid);
-			freeSpace(srcPath, linkPath, tarHead);
-			continue;
+			if (!result && job[i].result == 1) printf("uncompress: hf block %llu broken\n", (unsigned long long)i);
+			result = 1;
 		}
+	}
+	freeThreadPool(pool);
+	free(job);
+	fseeko(fout, outOffset, SEEK_SET);
+	return result;
+}
 
-		if (tarHead->type == FIFO)
+// the blocks of the mapped stream decoded on the thread pool a window ahead of the one fout takes, for a fout
+// that cannot be written out of order such as the ring into untar()
+int uncompressWindow(const unsigned char* stream, FILE* fout, blockIndex* index, u_int64_t count, u_int64_t end, u_int64_t size)
+{
+	int number = onlineThreadNumber();
+	int window = number * 2;
+	threadPool* pool = createThreadPool(number);
+	decodeJob* job = (decodeJob*)mallocAndReset(window * sizeof(decodeJob), 0);
+	for (int i = 0; i < window; i++)
+	{
+		job[i].out = (unsigned char*)mallocAndReset(size + DECODE_SYMBOLS, 0);
+		job[i].fout = -1;
+	}
+
+	u_int64_t submitted = 0;
+	u_int64_t written = 0;
+	int stop = 0;
+	int result = 0;
+	while (1)
+	{
+		while (!stop && submitted < count && submitted - written < window)
 		{
-			if (mkfifo(srcPath, fileMode))
+			decodeJob* next = job + submitted % window;
+			if (!(next->inLength = indexedBlockLength(index, count, end, submitted)) || index[submitted].length > size)
 			{
-				perror("mkfifo error");
-				freeSpace(srcPath, linkPath, tarHead);
-				return 1;
+				printf("uncompress: hf block index broken\n");
+				stop = result = 1;
+				break;
 			}
-			chmod(srcPath, fileMode);
-			chown(srcPath, uid, gid);
-			freeSpace(srcPath, linkPath, tarHead);
-			continue;
+			next->in = stream + index[submitted].offset;
+			next->length = index[submitted].length;
+			submitTask(pool, decodeBlockJob, next, &next->done);
+			submitted++;
 		}
+		if (written == submitted) break;
 
-		if (tarHead->type == BLOCK || tarHead->type == CHAR)
+		decodeJob* current = job + written % window;
+		waitTask(pool, &current->done);
+		if (!stop && current->result)
 		{
-			int major = charToNumber(tarHead->major);
-			int minor = charToNumber(tarHead->minor);
-			mode_t deviceMode;
-			if (tarHead->type == BLOCK) deviceMode = S_IFBLK;
-			else deviceMode = S_IFCHR;
-			if (mknod(srcPath, deviceMode, MKDEV(major, minor)))
-			{
-				perror("mknod error");
-				freeSpace(srcPath, linkPath, tarHead);
-				continue;
-			}
-			chmod(srcPath, fileMode);
-			chown(srcPath, uid, gid);
-			freeSpace(srcPath, linkPath, tarHead);
-			continue;
+			printf("uncompress: hf block %llu broken\n", (unsigned long long)written);
+			stop = result = 1;
 		}
+		// a reader that has all it wants, like untar() past the end of archive records, closes its end early
+		if (!stop && fwrite(current->out, 1, current->length, fout) != current->length) stop = 1;
+		written++;
+	}
 
-		FILE* fout = fopen(srcPath, "wb");
-		if (!fout)
+	freeThreadPool(pool);
+	for (int i = 0; i < window; i++) free(job[i].out);
+	free(job);
+	return result;
+}
+
+int uncompress(FILE* fin, FILE* fout)
+{
+	char magic[2];
+	int version = 0;
+	u_int64_t size = 0;
+	off_t start = ftello(fin);
+	if (fread(magic, 1, 2, fin) != 2 || memcmp(magic, HF_MAGIC, 2))
+	{
+		printf("uncompress: not a hf file\n");
+		return 1;
+	}
+	if ((version = fgetc(fin)) < HF_MIN_VERSION || version > HF_VERSION)
+	{
+		printf("uncompress: unsupported hf version %d\n", version);
+		return 1;
+	}
+	if (readVarint(&size, fin) || !size || size > MAX_BLOCK_SIZE)
+	{
+		printf("uncompress: bad hf block size\n");
+		return 1;
+	}
+
+	struct stat statBuf;
+	if (start >= 0)
+	{
+		off_t blockStart = ftello(fin);
+		blockIndex* index = NULL;
+		u_int64_t count = 0;
+		u_int64_t end = 0;
+		size_t mapLength = 0;
+		unsigned char* map = NULL;
+		if (!readBlockIndex(fin, start, &index, &count, &end) && (map = mapFile(fin, &mapLength)))
 		{
-			perror("open file error");
-			freeSpace(srcPath, linkPath, tarHead);
-			return 1;
+			int result = fileno(fout) >= 0 && !fstat(fileno(fout), &statBuf) && S_ISREG(statBuf.st_mode)
+				? uncompressParallel(map + start, fout, index, count, end)
+				: uncompressWindow(map + start, fout, index, count, end, size);
+			munmap(map, mapLength);
+			free(index);
+			return result;
 		}
+		free(index);
+		fseeko(fin, blockStart, SEEK_SET);
+	}
 
-		u_int64_t fileSize = charToNumber(tarHead->size);
-		int fileBlock = (fileSize + 511) / 512;
+	unsigned char* in = (unsigned char*)mallocAndReset(size + BLOCK_SLACK, 0);
+	unsigned char* out = (unsigned char*)mallocAndReset(size + DECODE_SYMBOLS, 0);
+	decodeTable table;
+	memset(&table, 0, sizeof(table));
 
-		for (u_int64_t i = 0; i < 512 * fileBlock; i++)
-		{
-			int ch;
-			if ((ch = fgetc(fin)) != EOF)
-			{
-				if (i < fileSize) fprintf(fout, "%c", ch);
-			}
-			else
-			{
-				perror("tar file shunhuai");
-				freeSpace(srcPath, linkPath, tarHead);
-				return 1;
-			}
+	int result = 0;
+	while (1)
+	{
+		int type = fgetc(fin);
+		if (type == HF_END) break;
 
+		u_int64_t length = 0;
+		u_int64_t payloadLength = 0;
+		if (type == EOF || readVarint(&length, fin) || readVarint(&payloadLength, fin) || length > size || payloadLength > size)
+		{
+			printf("uncompress: hf block header broken\n");
+			result = 1;
+			break;
 		}
+		if (fread(in, 1, payloadLength, fin) != payloadLength)
+		{
+			perror("uncompress read");
+			result = 1;
+			break;
+		}
+		if (decodeBlock(type, in, payloadLength, out, length, &table))
+		{
+			printf("uncompress: hf block broken\n");
+			result = 1;
+			break;
+		}
+		fwrite(out, 1, length, fout);
+	}
 
-		fclose(fout);
-
-		chmod(srcPath, fileMode);
+	free(in);
+	free(out);
+	free(table.entry);
 
-		chown(srcPath, uid, gid);
+	return result;
+}
 
-		u_int64_t mTime = charToNumber(tarHead->mtime);
-		struct utimbuf time;
-		time.actime = mTime;
-		time.modtime = mTime;
+void initRecordRing(recordRing* ring, size_t capacity)
+{
+	memset(ring, 0, sizeof(recordRing));
+	ring->buffer = (unsigned char*)mallocAndReset(capacity, 0);
+	ring->capacity = capacity;
+	pthread_mutex_init(&ring->lock, NULL);
+	pthread_cond_init(&ring->notEmpty, NULL);
+	pthread_cond_init(&ring->notFull, NULL);
+}
 
-		utime(srcPath, &time);
+void freeRecordRing(recordRing* ring)
+{
+	pthread_mutex_destroy(&ring->lock);
+	pthread_cond_destroy(&ring->notEmpty);
+	pthread_cond_destroy(&ring->notFull);
+	free(ring->buffer);
+}
 
-		freeSpace(srcPath, linkPath, tarHead);
+ssize_t writeRecordRing(void* cookie, const char* buffer, size_t size)
+{
+	recordRing* ring = (recordRing*)cookie;
+	size_t done = 0;
+	pthread_mutex_lock(&ring->lock);
+	while (done < size && !ring->closed)
+	{
+		while (ring->count == ring->capacity && !ring->closed) pthread_cond_wait(&ring->notFull, &ring->lock);
+		if (ring->closed) break;
+		size_t tail = (ring->head + ring->count) % ring->capacity;
+		size_t n = tail < ring->head ? ring->head - tail : ring->capacity - tail;
+		if (n > size - done) n = size - done;
+		memcpy(ring->buffer + tail, buffer + done, n);
+		ring->count += n;
+		done += n;
+		pthread_cond_signal(&ring->notEmpty);
 	}
+	pthread_mutex_unlock(&ring->lock);
+	return done ? done : -1;
+}
+
+ssize_t readRecordRing(void* cookie, char* buffer, size_t size)
+{
+	recordRing* ring = (recordRing*)cookie;
+	pthread_mutex_lock(&ring->lock);
+	while (!ring->count && !ring->closed) pthread_cond_wait(&ring->notEmpty, &ring->lock);
+	size_t n = ring->capacity - ring->head;
+	if (n > ring->count) n = ring->count;
+	if (n > size) n = size;
+	memcpy(buffer, ring->buffer + ring->head, n);
+	ring->head = (ring->head + n) % ring->capacity;
+	ring->count -= n;
+	pthread_cond_signal(&ring->notFull);
+	pthread_mutex_unlock(&ring->lock);
+	return n;
+}
+
+// either end closing lets the other run out: the reader sees end of file, the writer stops
+int closeRecordRing(void* cookie)
+{
+	recordRing* ring = (recordRing*)cookie;
+	pthread_mutex_lock(&ring->lock);
+	ring->closed = 1;
+	pthread_cond_broadcast(&ring->notEmpty);
+	pthread_cond_broadcast(&ring->notFull);
+	pthread_mutex_unlock(&ring->lock);
 	return 0;
 }
 
-int huffman()
+void* compressStage(void* argument)
 {
-	for (int i = 0; i < 256; i++)
+	compressPipe* pipe = (compressPipe*)argument;
+	pipe->result = compress(pipe->fin, pipe->fout);
+	fclose(pipe->fin);
+	return NULL;
+}
+
+// tar() straight into compress() through a bounded ring, no .tar on disk, fout may be a pipe
+int tarCompress(char* path, FILE* fout)
+{
+	cookie_io_functions_t writeFunctions = { NULL, writeRecordRing, NULL, closeRecordRing };
+	cookie_io_functions_t readFunctions = { readRecordRing, NULL, NULL, closeRecordRing };
+	recordRing ring;
+	initRecordRing(&ring, RING_BLOCKS * blockSize);
+
+	FILE* tarOut = fopencookie(&ring, "w", writeFunctions);
+	compressPipe pipe;
+	pipe.fin = fopencookie(&ring, "r", readFunctions);
+	pipe.fout = fout;
+	pipe.result = 1;
+	if (!tarOut || !pipe.fin)
 	{
-		if (Frequency[i])
-		{
-			huffmanNode* tempHuffmanNode = (huffmanNode*)mallocAndReset(sizeof(huffmanNode), 0);
-			tempHuffmanNode->ch = i;
-			linkNode* tempLinkNode = (linkNode*)mallocAndReset(sizeof(linkNode), 0);
-			tempLinkNode->frequency = Frequency[i];
-			tempLinkNode->node = tempHuffmanNode;
-			addLinkNode(tempLinkNode);
-		}
+		perror("fopencookie");
+		exit(1);
 	}
+	setvbuf(tarOut, NULL, _IOFBF, IO_BUFFER_SIZE);
+	setvbuf(pipe.fin, NULL, _IOFBF, IO_BUFFER_SIZE);
 
-	while (linkNodeHead.frequency > 1)
+	pthread_t compressThread;
+	if (pthread_create(&compressThread, NULL, compressStage, &pipe))
 	{
-		linkNode* left = linkNodeHead.next;
-		linkNode* right = left->next;
-		linkNodeHead.next = right->next;
-		huffmanNode* tempHuffmanNode = (huffmanNode*)mallocAndReset(sizeof(huffmanNode), 0);
-		tempHuffmanNode->ch = -1;
-		tempHuffmanNode->left = left->node;
-		tempHuffmanNode->right = right->node;
-		linkNode* tempLinkNode = (linkNode*)mallocAndReset(sizeof(linkNode), 0);
-		tempLinkNode->frequency = left->frequency + right->frequency;
-		tempLinkNode->node = tempHuffmanNode;
-		free(left);
-		free(right);
-		linkNodeHead.frequency = linkNodeHead.frequency - 2;
-		addLinkNode(tempLinkNode);
+		perror("pthread_create error");
+		exit(1);
 	}
 
-	linkNodeHead.node = linkNodeHead.next->node;
-	free(linkNodeHead.next);
-	linkNodeHead.next = NULL;
-	linkNodeHead.frequency = 0;
+	int result = tar(path, tarOut); // an unreadable entry still leaves a usable archive, but not a success
+	Record* lastRecord = (Record*)mallocAndReset(512, 0);
+	for (int i = 0; i < 2; i++) printOneBlock(lastRecord, tarOut);
+	free(lastRecord);
+	fclose(tarOut);
+	freeINode();
+	freeNameCache(&userNames);
+	freeNameCache(&groupNames);
 
-	return 0;
+	pthread_join(compressThread, NULL);
+	freeRecordRing(&ring);
+	return result | pipe.result;
+}
+
+void* uncompressStage(void* argument)
+{
+	compressPipe* pipe = (compressPipe*)argument;
+	pipe->result = uncompress(pipe->fin, pipe->fout);
+	fclose(pipe->fout);
+	return NULL;
 }
 
-int freeHuffman(huffmanNode* node)
+// uncompress() straight into untar() through a bounded ring, no .tar on disk, fin may be a pipe
+int untarDecompress(FILE* fin)
 {
-	if (node)
+	cookie_io_functions_t writeFunctions = { NULL, writeRecordRing, NULL, closeRecordRing };
+	cookie_io_functions_t readFunctions = { readRecordRing, NULL, NULL, closeRecordRing };
+	recordRing ring;
+	initRecordRing(&ring, RING_BLOCKS * blockSize);
+
+	FILE* tarIn = fopencookie(&ring, "r", readFunctions);
+	compressPipe pipe;
+	pipe.fin = fin;
+	pipe.fout = fopencookie(&ring, "w", writeFunctions);
+	pipe.result = 1;
+	if (!tarIn || !pipe.fout)
 	{
-		freeHuffman(node->left);
-		freeHuffman(node->right);
-		free(node);
+		perror("fopencookie");
+		exit(1);
 	}
-	return 0;
+	setvbuf(tarIn, NULL, _IOFBF, IO_BUFFER_SIZE);
+	setvbuf(pipe.fout, NULL, _IOFBF, IO_BUFFER_SIZE);
+
+	pthread_t uncompressThread;
+	if (pthread_create(&uncompressThread, NULL, uncompressStage, &pipe))
+	{
+		perror("pthread_create error");
+		exit(1);
+	}
+
+	int result = untar(tarIn);
+	fclose(tarIn); // if untar() stopped early this lets uncompress() run out
+
+	pthread_join(uncompressThread, NULL);
+	freeRecordRing(&ring);
+	return result || pipe.result;
 }
 
-int freeHuffmanTable()
+// strip the leading "/" and "./" tar() drops from member names
+const char* memberName(const char* path)
 {
-	for (int i =0;i<256;i++)
+	while (1)
 	{
-		if (huffmanTable[i].length)
-		{
-			free(huffmanTable[i].huffmanCode);
-			huffmanTable[i].length = 0;
-		}
+		if (path[0] == '/') path++;
+		else if (path[0] == '.' && path[1] == '/') path += 2;
+		else return path;
 	}
-	return 0;
 }
 
-int compress(FILE* fin, FILE* fout)
+// look path up in the member index and untar only the blocks covering it
+int extractMember(FILE* fin, const char* path)
 {
-	huffman();
-
-	char* huffmanCode = (char*)mallocAndReset(1, 0);
-	if (generateHuffmanCode(linkNodeHead.node, 0, huffmanCode)) free(huffmanCode);
+	off_t start = ftello(fin);
+	blockIndex* index = NULL;
+	u_int64_t count = 0;
+	u_int64_t end = 0;
+	if (start < 0 || readBlockIndex(fin, start, &index, &count, &end))
+	{
+		printf("extract: no block index\n");
+		return 1;
+	}
 
-	fprintf(fout, "%c", '\0');
-	for (int i = 0; i < 256; i++)
+	u_int64_t memberNumber = 0;
+	u_int64_t memberLength = 0;
+	if (readVarint(&memberNumber, fin) || readVarint(&memberLength, fin) || memberLength > end)
 	{
-		char* temp = (char*)&(Frequency[i]);
-		for (int j = 0; j < 8; j++) fprintf(fout, "%c", temp[j]);
+		printf("extract: no member index\n");
+		free(index);
+		return 1;
 	}
-	int ch;
-	char countLength = 0;
-	unsigned char compressCode = 0;
-	while ((ch = fgetc(fin)) != EOF)
+	unsigned char* member = (unsigned char*)mallocAndReset(memberLength + 1, 0);
+	if (fread(member, 1, memberLength, fin) != memberLength)
 	{
-		for (int i = 0; i < huffmanTable[ch].length; i++)
-		{
-			if (huffmanTable[ch].huffmanCode[i] == '0') compressCode = compressCode << 1;
-			else compressCode = (compressCode << 1) + 1;
-			countLength++;
-			if (countLength == 8)
-			{
-				fprintf(fout, "%c", compressCode);
-				countLength = 0;
-				compressCode = 0;
-			}
-		}
+		perror("extract read");
+		free(member);
+		free(index);
+		return 1;
 	}
-	fprintf(fout, "%c", compressCode << (8 - countLength));
-	fseek(fout, 0, SEEK_SET);
-	fprintf(fout, "%c", countLength);
 
-	freeHuffman(linkNodeHead.node);
-	freeHuffmanTable();
-	linkNodeHead.node = NULL;
+	const char* name = memberName(path);
+	size_t nameLength = strlen(name);
+	while (nameLength > 1 && name[nameLength - 1] == '/') nameLength--;
+	u_int64_t offset = 0;
+	u_int64_t length = 0;
+	int found = 0;
+	size_t n = 0;
+	for (u_int64_t i = 0; i < memberNumber && !found; i++)
+	{
+		u_int64_t entryNameLength = 0;
+		int m = getVarint(member + n, memberLength - n, &entryNameLength);
+		if (!m || entryNameLength > memberLength - n - m) break;
+		n += m;
+		const char* entryName = (const char*)member + n;
+		n += entryNameLength;
+		if (!(m = getVarint(member + n, memberLength - n, &offset))) break;
+		n += m;
+		if (!(m = getVarint(member + n, memberLength - n, &length))) break;
+		n += m;
+		if (entryNameLength && entryName[entryNameLength - 1] == '/') entryNameLength--;
+		found = entryNameLength == nameLength && !memcmp(entryName, name, nameLength);
+	}
+	free(member);
+	if (!found)
+	{
+		printf("%s: not in archive\n", path);
+		free(index);
+		return 1;
+	}
 
-	return 0;
-}
+	size_t mapLength = 0;
+	unsigned char* map = mapFile(fin, &mapLength);
+	if (!map)
+	{
+		perror("extract mmap");
+		free(index);
+		return 1;
+	}
 
-int uncompress(FILE* fin, FILE* fout)
-{
-	int lastLength = fgetc(fin);
-	int ch;
-	for (int i = 0; i < 256; i++)
+	u_int64_t blockStart = 0; // uncompressed offset of block i
+	u_int64_t rangeStart = 0;
+	unsigned char* range = NULL;
+	u_int64_t rangeLength = 0;
+	decodeTable table;
+	memset(&table, 0, sizeof(table));
+	int result = 0;
+	for (u_int64_t i = 0; i < count && blockStart < offset + length; blockStart += index[i].length, i++)
 	{
-		char* temp = (char*)&(Frequency[i]);
-		for (int j = 0; j < 8; j++)
+		if (blockStart + index[i].length <= offset) continue;
+		u_int64_t next = i + 1 < count ? index[i + 1].offset : end;
+		if (!range) rangeStart = blockStart;
+		if (next <= index[i].offset || index[i].length > MAX_BLOCK_SIZE)
 		{
-			if ((ch = fgetc(fin)) != EOF) temp[j] = ch;
-			else
-			{
-				perror("uncompress");
-				return 0;
-			}
-
+			result = 1;
+			break;
+		}
+		range = (unsigned char*)realloc(range, rangeLength + index[i].length + DECODE_SYMBOLS);
+		if (!range)
+		{
+			perror("realloc error");
+			exit(1);
 		}
+		if ((result = readBlock(map + start + index[i].offset, next - index[i].offset, range + rangeLength, index[i].length, &table))) break;
+		rangeLength += index[i].length;
+	}
+	free(table.entry);
+	free(index);
+	munmap(map, mapLength);
+	if (result || !range || offset + length > rangeStart + rangeLength)
+	{
+		printf("extract: hf block broken\n");
+		free(range);
+		return 1;
 	}
 
-	huffman();
+	unsigned char* entry = (unsigned char*)mallocAndReset(length + 1024, 0); // and the two end of archive records
+	memcpy(entry, range + (offset - rangeStart), length);
+	free(range);
+	FILE* entryFin = fmemopen(entry, length + 1024, "rb");
+	if (!entryFin)
+	{
+		perror("fmemopen");
+		free(entry);
+		return 1;
+	}
+	result = untar(entryFin);
+	fclose(entryFin);
+	free(entry);
+	return result;
+}
 
-	char temp;
-	if ((ch = fgetc(fin)) != EOF) temp = ch;
-	else
+int main(int argc, char* argv[])
+{
+	memset(&iNodeTable, 0, sizeof(linkTable));
+
+	while (argc > 1 && argv[1][0] == '-' && argv[1][1] && !argv[1][2] && strchr("n0123", argv[1][1]))
 	{
-		perror("uncompress read");
-		return 0;
+		if (argv[1][1] == 'n') numericOwner = 1; // -n -c|-t ..., ids only, no owner/group names
+		else compressLevel = argv[1][1] - '0'; // -0 to -3 before -c, LZ77 effort, 0 is order-0 coding only
+		argv++;
+		argc--;
 	}
-	huffmanNode* p = linkNodeHead.node;
-	while ((ch = fgetc(fin)) != EOF)
+
+	if (argc == 4 && !strcmp(argv[1], "-c")) // -c path archive.tar.hf, - for stdout
 	{
-		int length = 8;
-		while (length)
+		char* path = argv[2];
+		if (path[strlen(path) - 1] == '/' && strlen(path) > 1) path[strlen(path) - 1] = '\0';
+		FILE* fout = strcmp(argv[3], "-") ? fopen(argv[3], "wb") : stdout;
+		if (!fout)
 		{
-			if (p->ch == -1)
-			{
-				if (temp & 0x80) p = p->right;
-				else p = p->left;
-				length--;
-				temp = temp << 1;
-			}
-			else
-			{
-				fprintf(fout, "%c", p->ch);
-				p = linkNodeHead.node;
-			}
+			perror("fopen");
+			return 1;
 		}
-		temp = ch;
+		setvbuf(fout, NULL, _IOFBF, IO_BUFFER_SIZE);
+		int result = tarCompress(path, fout);
+		if (fclose(fout)) result = 1;
+		return result;
 	}
-	while (lastLength > -1)
+
+	if (argc == 4 && !strcmp(argv[1], "-t")) // -t path archive.tar, uncompressed, - for stdout
 	{
-		if (p->ch == -1)
+		char* path = argv[2];
+		if (path[strlen(path) - 1] == '/' && strlen(path) > 1) path[strlen(path) - 1] = '\0';
+		FILE* fout = strcmp(argv[3], "-") ? fopen(argv[3], "wb") : stdout;
+		if (!fout)
 		{
-			if (temp & 0x80) p = p->right;
-			else p = p->left;
-			lastLength--;
-			temp = temp << 1;
+			perror("fopen");
+			return 1;
 		}
-		else
+		setvbuf(fout, NULL, _IOFBF, IO_BUFFER_SIZE);
+		int result = tar(path, fout);
+		Record* lastRecord = (Record*)mallocAndReset(512, 0);
+		for (int i = 0; i < 2; i++) printOneBlock(lastRecord, fout);
+		free(lastRecord);
+		if (fclose(fout)) result = 1;
+		freeINode();
+		freeNameCache(&userNames);
+		freeNameCache(&groupNames);
+		return result;
+	}
+
+	if (argc >= 3 && !strcmp(argv[1], "-x")) // -x archive.tar.hf [member], - for stdin
+	{
+		FILE* fin = strcmp(argv[2], "-") ? fopen(argv[2], "rb") : stdin;
+		if (!fin)
 		{
-			fprintf(fout, "%c", p->ch);
-			p = linkNodeHead.node;
+			perror("fopen");
+			return 1;
 		}
+		setvbuf(fin, NULL, _IOFBF, IO_BUFFER_SIZE);
+		int result = argc > 3 ? extractMember(fin, argv[3]) : untarDecompress(fin);
+		fclose(fin);
+		return result;
 	}
 
-	freeHuffman(linkNodeHead.node);
-	freeHuffmanTable();
-	linkNodeHead.node = NULL;
-
-	return 0;
-}
-
-int main()
-{
-	memset(&iNodeHead, 0, sizeof(iNode));
-	memset(&linkNodeHead, 0, sizeof(linkNodeHead));
-
 	char path[] = "/home/ricksanchez/test";
 	char tarPath[] = "/home/ricksanchez/tarTest/test.tar";
 	char untarPath[] = "/home/ricksanchez/tarTest/test.tar";
@@ -937,6 +4412,7 @@ int main()
 		return 1;
 	}
 
+	setvbuf(fout, NULL, _IOFBF, IO_BUFFER_SIZE);
 	tar(path, fout);
 
 	Record* lastRecord = (Record*)mallocAndReset(512, 0);
@@ -946,13 +4422,18 @@ int main()
 	fclose(fout);
 
 	freeINode();
+	freeNameCache(&userNames);
+	freeNameCache(&groupNames);
 
 	FILE* untarFin = fopen(untarPath, "rb");
+	setvbuf(untarFin, NULL, _IOFBF, IO_BUFFER_SIZE);
 	untar(untarFin);
 	fclose(untarFin);
 
 	FILE* compressFin = fopen(tarPath, "rb");
 	FILE* compressFout = fopen(compressPath, "wb");
+	setvbuf(compressFin, NULL, _IOFBF, IO_BUFFER_SIZE);
+	setvbuf(compressFout, NULL, _IOFBF, IO_BUFFER_SIZE);
 
 	compress(compressFin, compressFout);
 
@@ -961,6 +4442,8 @@ int main()
 
 	FILE* uncompressFin = fopen(compressPath, "rb");
 	FILE* uncompressFout = fopen(uncompressPath, "wb");
+	setvbuf(uncompressFin, NULL, _IOFBF, IO_BUFFER_SIZE);
+	setvbuf(uncompressFout, NULL, _IOFBF, IO_BUFFER_SIZE);
 
 	uncompress(uncompressFin, uncompressFout);
 